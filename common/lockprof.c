@@ -0,0 +1,206 @@
+#include "lockprof.h"
+
+#ifdef LOCK_PROFILE
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#define MAX_HELD_LOCKS 16           // Deeper nesting is not timed
+
+// A lock the calling thread holds, so that unlock knows how long it was held and from where
+typedef struct {
+    pthread_mutex_t *mutex;
+    LockSite *site;
+    uint64_t acquired_ns;
+} HeldLock;
+
+static _Atomic(LockSite *) lock_sites = NULL;  // Every call site used so far
+static __thread HeldLock held_locks[MAX_HELD_LOCKS];
+static __thread int held_count = 0;
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int bucket_of(uint64_t ns) {
+    int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+    return bucket < LOCKPROF_BUCKETS ? bucket : LOCKPROF_BUCKETS - 1;
+}
+
+// Add a call site to the list the first time it is used
+static void register_site(LockSite *site) {
+    int expected = 0;
+
+    if (atomic_load_explicit(&site->registered, memory_order_relaxed) ||
+        !atomic_compare_exchange_strong(&site->registered, &expected, 1)) {
+        return;
+    }
+    site->next = atomic_load(&lock_sites);
+    while (!atomic_compare_exchange_weak(&lock_sites, &site->next, site)) {
+        // Another site was added first, site->next now holds the new head
+    }
+}
+
+static void record_wait(LockSite *site, uint64_t wait) {
+    atomic_fetch_add_explicit(&site->wait_ns, wait, memory_order_relaxed);
+    atomic_fetch_add_explicit(&site->wait_histogram[bucket_of(wait)], 1, memory_order_relaxed);
+}
+
+static void push_held(pthread_mutex_t *mutex, LockSite *site, uint64_t acquired_ns) {
+    if (held_count < MAX_HELD_LOCKS) {
+        held_locks[held_count].mutex = mutex;
+        held_locks[held_count].site = site;
+        held_locks[held_count].acquired_ns = acquired_ns;
+    }
+    held_count++;
+}
+
+// Charge the time mutex was held to the site that acquired it
+static void pop_held(pthread_mutex_t *mutex) {
+    int depth = held_count < MAX_HELD_LOCKS ? held_count : MAX_HELD_LOCKS;
+
+    // Locks are usually released in reverse order, so search from the top
+    for (int i = depth - 1; i >= 0; i--) {
+        if (held_locks[i].mutex == mutex) {
+            uint64_t hold = now_ns() - held_locks[i].acquired_ns;
+            LockSite *site = held_locks[i].site;
+            atomic_fetch_add_explicit(&site->hold_ns, hold, memory_order_relaxed);
+            atomic_fetch_add_explicit(&site->hold_histogram[bucket_of(hold)], 1, memory_order_relaxed);
+
+            memmove(&held_locks[i], &held_locks[i + 1], (depth - i - 1) * sizeof(HeldLock));
+            held_count--;
+            return;
+        }
+    }
+    // Not found: locked too deep to be timed, or unlocked without being locked
+    if (held_count > MAX_HELD_LOCKS)
+        held_count--;
+}
+
+int lockprof_lock(pthread_mutex_t *mutex, LockSite *site) {
+    register_site(site);
+
+    // Only a lock that is already taken costs a wait
+    int result = pthread_mutex_trylock(mutex);
+    uint64_t acquired = now_ns();
+    if (result == EBUSY) {
+        uint64_t start = acquired;
+        result = pthread_mutex_lock(mutex);
+        acquired = now_ns();
+        atomic_fetch_add_explicit(&site->contended, 1, memory_order_relaxed);
+        record_wait(site, acquired - start);
+    }
+    if (result != 0)
+        return result;
+
+    atomic_fetch_add_explicit(&site->acquisitions, 1, memory_order_relaxed);
+    push_held(mutex, site, acquired);
+    return 0;
+}
+
+int lockprof_unlock(pthread_mutex_t *mutex) {
+    pop_held(mutex);
+    return pthread_mutex_unlock(mutex);
+}
+
+// The wait releases the mutex, so the hold before it ends here and a new one starts on wakeup
+int lockprof_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex, const struct timespec *abstime,
+                       LockSite *site) {
+    register_site(site);
+    pop_held(mutex);
+
+    uint64_t start = now_ns();
+    int result = abstime ? pthread_cond_timedwait(cond, mutex, abstime) : pthread_cond_wait(cond, mutex);
+    uint64_t woken = now_ns();
+
+    atomic_fetch_add_explicit(&site->acquisitions, 1, memory_order_relaxed);
+    record_wait(site, woken - start);
+    push_held(mutex, site, woken);
+    return result;
+}
+
+static void print_duration(FILE *file, uint64_t ns) {
+    if (ns < 1000) {
+        fprintf(file, "%lluns", (unsigned long long)ns);
+    } else if (ns < 1000000) {
+        fprintf(file, "%lluus", (unsigned long long)(ns / 1000));
+    } else if (ns < 1000000000) {
+        fprintf(file, "%llums", (unsigned long long)(ns / 1000000));
+    } else {
+        fprintf(file, "%llus", (unsigned long long)(ns / 1000000000));
+    }
+}
+
+// Print the non-empty buckets as ">=lower bound:count", nothing if all are empty
+static void print_histogram(FILE *file, const char *title, _Atomic long *histogram) {
+    long total = 0;
+    for (int i = 0; i < LOCKPROF_BUCKETS; i++) {
+        total += atomic_load(&histogram[i]);
+    }
+    if (total == 0)
+        return;
+
+    fprintf(file, "    %s:", title);
+    for (int i = 0; i < LOCKPROF_BUCKETS; i++) {
+        long count = atomic_load(&histogram[i]);
+        if (count > 0) {
+            fprintf(file, " >=");
+            print_duration(file, i ? 1ULL << i : 0);
+            fprintf(file, ":%ld", count);
+        }
+    }
+    fprintf(file, "\n");
+}
+
+void lockprof_report(FILE *file) {
+    LockSite *sites = atomic_load(&lock_sites);
+
+    fprintf(file, "lock profile:\n");
+    for (LockSite *first = sites; first; first = first->next) {
+        // Report each lock once, at the first of its call sites in the list
+        int seen = 0;
+        for (LockSite *site = sites; site != first && !seen; site = site->next) {
+            seen = strcmp(site->lock, first->lock) == 0;
+        }
+        if (seen)
+            continue;
+
+        long acquisitions = 0, contended = 0;
+        long long wait_ns = 0, hold_ns = 0;
+        for (LockSite *site = first; site; site = site->next) {
+            if (strcmp(site->lock, first->lock) != 0)
+                continue;
+            hold_ns += atomic_load(&site->hold_ns);
+            if (!site->is_cond_wait) {
+                acquisitions += atomic_load(&site->acquisitions);
+                contended += atomic_load(&site->contended);
+                wait_ns += atomic_load(&site->wait_ns);
+            }
+        }
+        fprintf(file, "%s: %ld acquisitions, %ld contended (%.1f%%), waited %.3f ms, held %.3f ms\n", first->lock,
+                acquisitions, contended, acquisitions ? 100.0 * contended / acquisitions : 0.0, wait_ns / 1e6,
+                hold_ns / 1e6);
+
+        for (LockSite *site = first; site; site = site->next) {
+            if (strcmp(site->lock, first->lock) != 0)
+                continue;
+            if (site->is_cond_wait) {
+                fprintf(file, "  %s:%d cond wait: %ld wakeups, blocked %.3f ms, held after wakeup %.3f ms\n",
+                        site->file, site->line, atomic_load(&site->acquisitions), atomic_load(&site->wait_ns) / 1e6,
+                        atomic_load(&site->hold_ns) / 1e6);
+                print_histogram(file, "blocked", site->wait_histogram);
+            } else {
+                fprintf(file, "  %s:%d lock: %ld acquisitions, %ld contended, waited %.3f ms, held %.3f ms\n",
+                        site->file, site->line, atomic_load(&site->acquisitions), atomic_load(&site->contended),
+                        atomic_load(&site->wait_ns) / 1e6, atomic_load(&site->hold_ns) / 1e6);
+                print_histogram(file, "wait", site->wait_histogram);
+            }
+            print_histogram(file, "hold", site->hold_histogram);
+        }
+    }
+}
+
+#endif
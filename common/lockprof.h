@@ -0,0 +1,64 @@
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+
+#include <pthread.h>
+#include <stdio.h>
+
+// Lock contention profiler for pthread mutexes, compiled in with -DLOCK_PROFILE.
+//
+// Use MUTEX_LOCK, MUTEX_UNLOCK, COND_WAIT and COND_TIMEDWAIT in place of the pthread calls.
+// With LOCK_PROFILE defined every call site counts its acquisitions, how many of them had to
+// wait, and log2 histograms of the wait time and of how long the lock was then held; waits on
+// condition variables are reported separately. lockprof_report prints a summary per lock and per
+// call site. Without LOCK_PROFILE the macros are the plain pthread calls.
+//
+// Locks are told apart by the text of the mutex expression, so a lock must be spelled the same
+// way at every call site (e.g. always &client->out_mutex, never &clients[i]->out_mutex).
+
+#ifdef LOCK_PROFILE
+
+#include <stdatomic.h>
+#include <time.h>
+
+#define LOCKPROF_BUCKETS 32         // Bucket i counts durations in [2^i, 2^(i+1)) ns
+
+typedef struct LockSite {
+    const char *lock;               // Mutex expression as written at the call site
+    const char *file;
+    int line;
+    int is_cond_wait;
+    _Atomic int registered;
+    _Atomic long acquisitions;      // For a condition wait, the number of wakeups
+    _Atomic long contended;
+    _Atomic long long wait_ns;
+    _Atomic long long hold_ns;      // Held from this site until the next unlock or wait
+    _Atomic long wait_histogram[LOCKPROF_BUCKETS];
+    _Atomic long hold_histogram[LOCKPROF_BUCKETS];
+    struct LockSite *next;
+} LockSite;
+
+int lockprof_lock(pthread_mutex_t *mutex, LockSite *site);
+int lockprof_unlock(pthread_mutex_t *mutex);
+int lockprof_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex, const struct timespec *abstime,
+                       LockSite *site);
+void lockprof_report(FILE *file);
+
+#define LOCKPROF_SITE(m, cond_wait) \
+    static LockSite lockprof_site = { #m, __FILE__, __LINE__, cond_wait }
+
+#define MUTEX_LOCK(m) ({ LOCKPROF_SITE(m, 0); lockprof_lock(m, &lockprof_site); })
+#define MUTEX_UNLOCK(m) lockprof_unlock(m)
+#define COND_WAIT(c, m) ({ LOCKPROF_SITE(m, 1); lockprof_cond_wait(c, m, NULL, &lockprof_site); })
+#define COND_TIMEDWAIT(c, m, t) ({ LOCKPROF_SITE(m, 1); lockprof_cond_wait(c, m, t, &lockprof_site); })
+
+#else
+
+#define MUTEX_LOCK(m) pthread_mutex_lock(m)
+#define MUTEX_UNLOCK(m) pthread_mutex_unlock(m)
+#define COND_WAIT(c, m) pthread_cond_wait(c, m)
+#define COND_TIMEDWAIT(c, m, t) pthread_cond_timedwait(c, m, t)
+#define lockprof_report(file) ((void)(file))
+
+#endif
+
+#endif
@@ -0,0 +1,218 @@
+#define _GNU_SOURCE  // gettid through syscall
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/syscall.h>
+
+#define TRACE_CHUNK_EVENTS 4096                 // Events per buffer chunk
+#define TRACE_MAX_EVENTS_PER_THREAD (1 << 20)   // Later events are counted as dropped
+
+typedef struct {
+    const char *name;
+    const char *category;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    char phase;                     // 'X' for a span, 'i' for an instant
+} TraceEvent;
+
+typedef struct TraceChunk {
+    TraceEvent events[TRACE_CHUNK_EVENTS];
+    _Atomic int count;              // Published with release so the writer can read a live chunk
+    struct TraceChunk *next;
+} TraceChunk;
+
+// One per thread. Only its thread appends, buffers are never freed so that events of threads
+// that already exited are still written.
+typedef struct TraceBuffer {
+    long tid;
+    char thread_name[64];
+    TraceChunk *first;
+    TraceChunk *last;
+    long events;
+    long dropped;
+    struct TraceBuffer *next;
+} TraceBuffer;
+
+int trace_enabled = 0;
+
+static char trace_path[4096];
+static char trace_process_name[64];
+static uint64_t trace_start_ns;
+static _Atomic(TraceBuffer *) trace_buffers = NULL;  // Lock-free list of every thread's buffer
+static __thread TraceBuffer *thread_buffer = NULL;
+
+uint64_t trace_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void trace_init(const char *process_name) {
+    const char *path = getenv("HW_TRACE");
+    if (path == NULL || *path == '\0')
+        return;
+
+    // Expand "%p" so that several processes can trace into one directory
+    const char *pid_marker = strstr(path, "%p");
+    if (pid_marker) {
+        snprintf(trace_path, sizeof(trace_path), "%.*s%d%s", (int)(pid_marker - path), path, getpid(),
+                 pid_marker + 2);
+    } else {
+        snprintf(trace_path, sizeof(trace_path), "%s", path);
+    }
+    snprintf(trace_process_name, sizeof(trace_process_name), "%s", process_name);
+    trace_start_ns = trace_now_ns();
+    trace_enabled = 1;
+    atexit(trace_flush);
+}
+
+// Get the calling thread's buffer, creating and publishing it on first use
+static TraceBuffer *get_buffer(void) {
+    if (thread_buffer)
+        return thread_buffer;
+
+    TraceBuffer *buffer = calloc(1, sizeof(TraceBuffer));
+    if (buffer == NULL)
+        return NULL;
+    buffer->tid = syscall(SYS_gettid);
+
+    buffer->next = atomic_load(&trace_buffers);
+    while (!atomic_compare_exchange_weak(&trace_buffers, &buffer->next, buffer)) {
+        // Another thread published its buffer first, buffer->next now holds the new head
+    }
+    thread_buffer = buffer;
+    return buffer;
+}
+
+static void record(const char *name, const char *category, char phase, uint64_t start_ns, uint64_t end_ns) {
+    TraceBuffer *buffer = get_buffer();
+    if (buffer == NULL)
+        return;
+    if (buffer->events >= TRACE_MAX_EVENTS_PER_THREAD) {
+        buffer->dropped++;
+        return;
+    }
+
+    TraceChunk *chunk = buffer->last;
+    int count = chunk ? atomic_load_explicit(&chunk->count, memory_order_relaxed) : TRACE_CHUNK_EVENTS;
+    if (count == TRACE_CHUNK_EVENTS) {
+        TraceChunk *next = malloc(sizeof(TraceChunk));
+        if (next == NULL) {
+            buffer->dropped++;
+            return;
+        }
+        atomic_init(&next->count, 0);
+        next->next = NULL;
+        if (chunk) {
+            chunk->next = next;
+        } else {
+            buffer->first = next;
+        }
+        buffer->last = chunk = next;
+        count = 0;
+    }
+
+    TraceEvent *event = &chunk->events[count];
+    event->name = name;
+    event->category = category;
+    event->phase = phase;
+    event->start_ns = start_ns;
+    event->duration_ns = end_ns - start_ns;
+    buffer->events++;
+    atomic_store_explicit(&chunk->count, count + 1, memory_order_release);
+}
+
+void trace_span(const char *name, const char *category, uint64_t start_ns, uint64_t end_ns) {
+    record(name, category, 'X', start_ns, end_ns);
+}
+
+void trace_instant(const char *name, const char *category) {
+    uint64_t now = trace_now_ns();
+    record(name, category, 'i', now, now);
+}
+
+void trace_thread_name(const char *name) {
+    if (!trace_enabled)
+        return;
+    TraceBuffer *buffer = get_buffer();
+    if (buffer)
+        snprintf(buffer->thread_name, sizeof(buffer->thread_name), "%s", name);
+}
+
+// Print a nanosecond offset from the start of the trace in microseconds, as the format wants
+static void print_us(FILE *file, uint64_t ns) {
+    fprintf(file, "%llu.%03llu", (unsigned long long)(ns / 1000), (unsigned long long)(ns % 1000));
+}
+
+// Print a JSON string, thread names may come from users
+static void print_json_string(FILE *file, const char *text) {
+    fputc('"', file);
+    for (const unsigned char *c = (const unsigned char *)text; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(file, "\\%c", *c);
+        } else if (*c < 0x20) {
+            fprintf(file, "\\u%04x", *c);
+        } else {
+            fputc(*c, file);
+        }
+    }
+    fputc('"', file);
+}
+
+void trace_flush(void) {
+    if (!trace_enabled)
+        return;
+
+    FILE *file = fopen(trace_path, "w");
+    if (file == NULL) {
+        perror("Error opening trace file");
+        return;
+    }
+
+    int pid = getpid();
+    long dropped = 0;
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":", pid, pid);
+    print_json_string(file, trace_process_name);
+    fprintf(file, "}}");
+
+    for (TraceBuffer *buffer = atomic_load(&trace_buffers); buffer; buffer = buffer->next) {
+        if (buffer->thread_name[0] != '\0') {
+            fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%ld,\"args\":{\"name\":",
+                    pid, buffer->tid);
+            print_json_string(file, buffer->thread_name);
+            fprintf(file, "}}");
+        }
+        for (TraceChunk *chunk = buffer->first; chunk; chunk = chunk->next) {
+            int count = atomic_load_explicit(&chunk->count, memory_order_acquire);
+            for (int i = 0; i < count; i++) {
+                TraceEvent *event = &chunk->events[i];
+                // Spans recorded after the fact may start before tracing did
+                uint64_t start = event->start_ns > trace_start_ns ? event->start_ns - trace_start_ns : 0;
+
+                fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\",\"pid\":%d,\"tid\":%ld,\"ts\":",
+                        event->name, event->category, event->phase, pid, buffer->tid);
+                print_us(file, start);
+                if (event->phase == 'X') {
+                    fprintf(file, ",\"dur\":");
+                    print_us(file, event->duration_ns);
+                } else {
+                    fprintf(file, ",\"s\":\"t\"");
+                }
+                fprintf(file, "}");
+            }
+        }
+        dropped += buffer->dropped;
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+
+    if (dropped > 0)
+        fprintf(stderr, "trace: %ld events dropped\n", dropped);
+    trace_enabled = 0;
+}
@@ -0,0 +1,42 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+// Lightweight span tracing shared by the shell, the dispatcher and the chat server.
+//
+// Setting HW_TRACE=<file> turns tracing on. Every thread records into its own buffer without
+// taking locks, and the events are written to <file> at exit as Chrome trace-event JSON, which
+// chrome://tracing and ui.perfetto.dev open directly. A "%p" in the file name is replaced by the
+// process id. With tracing off, an instrumented span costs one load and one branch.
+//
+// Span and category names must be string literals (or otherwise live until exit).
+
+extern int trace_enabled;
+
+// Read HW_TRACE and, if set, name the process in the trace and register the writer with atexit
+void trace_init(const char *process_name);
+
+// CLOCK_MONOTONIC in nanoseconds
+uint64_t trace_now_ns(void);
+
+// Record a span that started at start_ns and ended at end_ns on the calling thread
+void trace_span(const char *name, const char *category, uint64_t start_ns, uint64_t end_ns);
+
+// Record a point event on the calling thread
+void trace_instant(const char *name, const char *category);
+
+// Name the calling thread in the trace, name is copied
+void trace_thread_name(const char *name);
+
+// Write every recorded event to the trace file, called automatically at exit
+void trace_flush(void);
+
+// Usage:  TRACE_BEGIN(t); work(); TRACE_END(t, "work", "category");
+#define TRACE_BEGIN(var) uint64_t var = trace_enabled ? trace_now_ns() : 0
+#define TRACE_END(var, name, category)                             \
+    do {                                                           \
+        if (trace_enabled) trace_span(name, category, var, trace_now_ns()); \
+    } while (0)
+
+#endif
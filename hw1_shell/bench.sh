@@ -0,0 +1,26 @@
+#!/bin/sh
+# Benchmark hw1shell: how fast a script of simple commands, of pipelines and a parallel
+# command list run, and what posix_spawn saves over fork+exec ("run" jobs are forked so that
+# their limits can be applied between fork and exec). Prints "metric: value" lines, collected by
+# "make bench" at the top level.
+set -e
+cd "$(dirname "$0")"
+COMMANDS=${COMMANDS:-2000}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+now_ns() { date +%s%N; }
+rate() { awk "BEGIN { printf \"%.0f\", $1 / (($3 - $2) / 1e9) }"; }
+
+seq "$COMMANDS" | sed 's/.*/true/' > "$work/simple"
+seq "$COMMANDS" | sed 's/.*/echo x | cat/' > "$work/pipelines"
+seq "$COMMANDS" | sed 's/.*/true/' > "$work/list"
+echo "parallel -j $(nproc) $work/list" > "$work/parallel"
+seq "$COMMANDS" | sed 's/.*/run true/' > "$work/forked"
+
+for kind in simple pipelines parallel forked; do
+    start=$(now_ns)
+    ./hw1shell "$work/$kind" > /dev/null
+    end=$(now_ns)
+    echo "hw1 $kind commands/s: $(rate "$COMMANDS" "$start" "$end")"
+done
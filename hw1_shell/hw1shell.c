@@ -1,132 +1,1561 @@
+#define _GNU_SOURCE  // pipe2, POSIX_SPAWN_USEVFORK, sched_setaffinity
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <errno.h>
 
+#include "../common/trace.h"
+
 #define CMD_MAX_LENGTH 1024
-#define ARG_MAX_COUNT 64
-#define MAX_BG_JOBS 4
+#define INPUT_CHUNK_SIZE (64 * 1024)
+#define MAX_PIPE_STAGES 16
+#define INITIAL_JOB_CAPACITY 16
+#define CPU_PERIOD_USEC 100000      // cpu.max period of job cgroups
+#define RECENT_JOB_COUNT 32         // Finished background jobs kept for "jobs -l"
+
+extern char **environ;
+
+// How a job was started, which decides how its completion is reported
+typedef enum {
+    JOB_BACKGROUND,                 // Started with "&", moved to recentJobs once it finishes
+    JOB_FOREGROUND,                 // Waited for by the shell
+    JOB_PARALLEL                    // Started by the parallel built-in
+} JobKind;
 
 typedef struct {
-    pid_t pid;
+    int id;                         // Job id (slot index + 1), 0 when the slot is free
+    pid_t pid;                      // Pid reported to the user (the last stage of a pipeline)
+    int stagesRunning;
+    JobKind kind;
+    int exitStatus;                 // Wait status of the last stage
+    struct timespec startTime;
+    struct timespec endTime;
+    struct rusage usage;            // Summed over all stages, max RSS is the largest stage
+    char *cgroupDir;                // Leaf cgroup created by "run", removed when the job finishes
     char command[CMD_MAX_LENGTH];
 } BackgroundJob;
 
-BackgroundJob bgJobs[MAX_BG_JOBS];
-int activeJobs = 0;
+// Limits placed on the processes of a job by the run built-in
+typedef struct {
+    double cpus;                    // CPU bandwidth, 0 for no limit
+    long long memory;               // Bytes, 0 for no limit
+    int useAffinity;
+    cpu_set_t affinity;
+    char *cgroupDir;                // Leaf cgroup of the job, NULL to fall back to rlimits
+    int cgroupProcsFd;              // cgroup.procs of cgroupDir, -1 without a cgroup
+} JobLimits;
 
-void executeCommand(char *args[], int isBackground) {
-    pid_t pid = fork();
+// A command resolved through $PATH
+typedef struct {
+    char *name;                     // NULL for an empty bucket
+    char *path;
+    int dirIndex;                   // Index of the $PATH directory it was found in
+    int hits;
+} CommandEntry;
 
-    if (pid == -1) {
-        printf("hw1shell: fork failed, errno is %d\n", errno);
-    } else if (pid == 0) {
-        // Child process
-        if (isBackground && activeJobs == MAX_BG_JOBS)
+typedef struct {
+    char *dir;
+    struct timespec mtime;          // Modification time when $PATH was last loaded
+} PathDir;
+
+// A built-in command
+typedef struct {
+    const char *name;
+    void (*run)(char *args[], int isBackground);
+} Builtin;
+
+// Open-addressing hash from a child pid to its job slot
+typedef struct {
+    pid_t pid;                      // 0 for an empty bucket, -1 for a deleted one
+    int slot;
+} PidBucket;
+
+// One command of a pipeline, with its redirections
+typedef struct {
+    char **argv;
+    char *inputFile;
+    char *outputFile;
+    int appendOutput;
+} PipelineStage;
+
+// Shell operators. tokenize replaces an unquoted operator word with the string from this table, so
+// a word is an operator only if it points here and a quoted "|" or '>' stays a plain argument.
+enum { OP_PIPE, OP_INPUT, OP_OUTPUT, OP_APPEND, OP_BACKGROUND, OP_COUNT };
+char operatorText[OP_COUNT][3] = {"|", "<", ">", ">>", "&"};
+#define IS_OPERATOR(arg, op) ((arg) == operatorText[op])
+
+// Growable job table indexed by job id, with a stack of free slots so adding and removing are O(1)
+BackgroundJob *bgJobs = NULL;
+int jobCapacity = 0;
+int *freeSlots = NULL;
+int freeSlotCount = 0;
+
+// Ring of the last finished background jobs, whose slots are already released
+BackgroundJob recentJobs[RECENT_JOB_COUNT];
+int recentJobStart = 0;
+int recentJobCount = 0;
+
+PidBucket *pidMap = NULL;
+int pidMapCapacity = 0;             // Always a power of two
+int pidMapUsed = 0;                 // Live and deleted buckets
+
+int childSignalFd = -1;             // Readable when a child has changed state
+FILE *profileLog = NULL;            // CSV log of every finished job, enabled by $HW1SHELL_PROFILE
+
+// Command path cache, like bash's "hash": open addressing on the command name
+CommandEntry *commandCache = NULL;
+int commandCacheCapacity = 0;       // Always a power of two
+int commandCacheCount = 0;
+long commandCacheHits = 0;
+long commandCacheMisses = 0;
+char *cachedPath = NULL;            // $PATH the cache was built for
+PathDir *pathDirs = NULL;
+int pathDirCount = 0;
+
+// Commands are read in large chunks from stdin or the script given on the command line
+int inputFd = STDIN_FILENO;
+int interactive = 1;                // Prompts are printed only for a terminal
+char *inputBuffer = NULL;
+size_t inputCapacity = 0;
+size_t inputStart = 0;              // First unread byte
+size_t inputEnd = 0;                // One past the last buffered byte
+int inputEof = 0;
+
+int cgroupJobCount = 0;             // Names job cgroups uniquely
+int nextCpu = 0;                    // Where the next "run --cpus" job starts picking CPUs
+
+// Find the bucket for pid, or the empty bucket where it would go
+PidBucket *pidMapFind(pid_t pid) {
+    unsigned int mask = pidMapCapacity - 1;
+    unsigned int i = ((unsigned int)pid * 2654435761u) & mask;
+    PidBucket *deleted = NULL;
+
+    while (pidMap[i].pid != 0) {
+        if (pidMap[i].pid == pid)
+            return &pidMap[i];
+        if (pidMap[i].pid == -1 && deleted == NULL)
+            deleted = &pidMap[i];
+        i = (i + 1) & mask;
+    }
+    return deleted ? deleted : &pidMap[i];
+}
+
+void pidMapInsert(pid_t pid, int slot) {
+    // Keep the load factor (deleted buckets included) under one half
+    if ((pidMapUsed + 1) * 2 > pidMapCapacity) {
+        PidBucket *old = pidMap;
+        int oldCapacity = pidMapCapacity;
+
+        // Size the new table from the live pids, so a table full of deleted buckets is rebuilt at
+        // the same size (or smaller) instead of doubling. Live pids take at most a quarter of it.
+        int live = 0;
+        for (int i = 0; i < oldCapacity; i++) {
+            if (old[i].pid > 0)
+                live++;
+        }
+        pidMapCapacity = 64;
+        while ((live + 1) * 4 > pidMapCapacity) {
+            pidMapCapacity *= 2;
+        }
+        pidMap = calloc(pidMapCapacity, sizeof(PidBucket));
+        if (pidMap == NULL) {
+            perror("calloc");
             exit(EXIT_FAILURE);
+        }
+        pidMapUsed = 0;
+        for (int i = 0; i < oldCapacity; i++) {
+            if (old[i].pid > 0) {
+                *pidMapFind(old[i].pid) = old[i];
+                pidMapUsed++;
+            }
+        }
+        free(old);
+    }
 
-        if (execvp(args[0], args) == -1) {
-            printf("hw1shell: invalid command\n");
-            printf("hw1shell: execvp failed, errno is %d\n", errno);
+    PidBucket *bucket = pidMapFind(pid);
+    if (bucket->pid == 0)
+        pidMapUsed++;
+    bucket->pid = pid;
+    bucket->slot = slot;
+}
+
+// Remove pid from the map, returns its job slot or -1 if pid is not a background job
+int pidMapRemove(pid_t pid) {
+    if (pidMapCapacity == 0)
+        return -1;
+
+    PidBucket *bucket = pidMapFind(pid);
+    if (bucket->pid != pid)
+        return -1;
+    bucket->pid = -1;
+    return bucket->slot;
+}
+
+// Take a free job slot, growing the table when none is left
+BackgroundJob *allocateJob() {
+    if (freeSlotCount == 0) {
+        int newCapacity = jobCapacity ? jobCapacity * 2 : INITIAL_JOB_CAPACITY;
+        BackgroundJob *jobs = realloc(bgJobs, newCapacity * sizeof(BackgroundJob));
+        int *slots = realloc(freeSlots, newCapacity * sizeof(int));
+        if (jobs == NULL || slots == NULL) {
+            perror("realloc");
             exit(EXIT_FAILURE);
         }
-    } else {
-        // Parent process
-        if (isBackground) {
-            if (activeJobs < MAX_BG_JOBS) {
-                printf("hw1shell: %d started\n", pid);
-                bgJobs[activeJobs].pid = pid;
-                strncpy(bgJobs[activeJobs].command, args[0], CMD_MAX_LENGTH - 1);
-                bgJobs[activeJobs].command[CMD_MAX_LENGTH - 1] = '\0';
-                activeJobs++;
+        bgJobs = jobs;
+        freeSlots = slots;
+
+        // Push the new slots so that the lowest job ids are handed out first
+        for (int i = newCapacity - 1; i >= jobCapacity; i--) {
+            bgJobs[i].id = 0;
+            freeSlots[freeSlotCount++] = i;
+        }
+        jobCapacity = newCapacity;
+    }
+
+    int slot = freeSlots[--freeSlotCount];
+    bgJobs[slot].id = slot + 1;
+    return &bgJobs[slot];
+}
+
+void releaseJob(BackgroundJob *job) {
+    freeSlots[freeSlotCount++] = job->id - 1;
+    job->id = 0;
+}
+
+// Split args into pipeline stages at "|" and pull out "<", ">" and ">>" redirections.
+// args is modified in place. Returns the number of stages, or -1 on a syntax error.
+int parsePipeline(char *args[], PipelineStage stages[]) {
+    int stageCount = 0;
+    int out = 0;
+
+    stages[0].argv = args;
+    stages[0].inputFile = stages[0].outputFile = NULL;
+    stages[0].appendOutput = 0;
+
+    for (int in = 0; args[in] != NULL; in++) {
+        PipelineStage *stage = &stages[stageCount];
+
+        if (IS_OPERATOR(args[in], OP_PIPE)) {
+            if (stage->argv == &args[out] || stageCount + 1 == MAX_PIPE_STAGES)
+                return -1;
+            args[out++] = NULL;
+            stage = &stages[++stageCount];
+            stage->argv = &args[out];
+            stage->inputFile = stage->outputFile = NULL;
+            stage->appendOutput = 0;
+        } else if (IS_OPERATOR(args[in], OP_INPUT)) {
+            if (args[in + 1] == NULL)
+                return -1;
+            stage->inputFile = args[++in];
+        } else if (IS_OPERATOR(args[in], OP_OUTPUT) || IS_OPERATOR(args[in], OP_APPEND)) {
+            if (args[in + 1] == NULL)
+                return -1;
+            stage->appendOutput = IS_OPERATOR(args[in], OP_APPEND);
+            stage->outputFile = args[++in];
+        } else {
+            args[out++] = args[in];
+        }
+    }
+    args[out] = NULL;
+
+    if (stages[stageCount].argv[0] == NULL)
+        return -1;
+    return stageCount + 1;
+}
+
+// Hash a string with FNV-1a
+unsigned int hashString(const char *s) {
+    unsigned int hash = 2166136261u;
+    while (*s) {
+        hash ^= (unsigned char)*s++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Forget every resolved command
+void flushCommandCache() {
+    if (commandCache == NULL)
+        return;
+    for (int i = 0; i < commandCacheCapacity; i++) {
+        free(commandCache[i].name);
+        free(commandCache[i].path);
+    }
+    memset(commandCache, 0, commandCacheCapacity * sizeof(CommandEntry));
+    commandCacheCount = 0;
+}
+
+// Split $PATH into directories and remember their modification times
+void loadPathDirs(const char *path) {
+    for (int i = 0; i < pathDirCount; i++) {
+        free(pathDirs[i].dir);
+    }
+    free(pathDirs);
+    free(cachedPath);
+
+    cachedPath = strdup(path);
+    pathDirCount = 1;
+    for (const char *c = path; *c; c++) {
+        if (*c == ':')
+            pathDirCount++;
+    }
+    pathDirs = calloc(pathDirCount, sizeof(PathDir));
+    if (cachedPath == NULL || pathDirs == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    const char *start = path;
+    for (int i = 0; i < pathDirCount; i++) {
+        const char *end = strchr(start, ':');
+        int length = end ? end - start : (int)strlen(start);
+
+        // An empty entry means the current directory
+        pathDirs[i].dir = length ? strndup(start, length) : strdup(".");
+        struct stat st;
+        if (stat(pathDirs[i].dir, &st) == 0)
+            pathDirs[i].mtime = st.st_mtim;
+        start = end ? end + 1 : start + length;
+    }
+}
+
+// Check that no directory up to and including dirIndex has changed since it was loaded.
+// A change there can add a command that shadows a cached one or remove a cached one.
+int pathDirsUnchanged(int dirIndex) {
+    for (int i = 0; i <= dirIndex && i < pathDirCount; i++) {
+        struct stat st;
+        struct timespec mtime = { 0, 0 };
+        if (stat(pathDirs[i].dir, &st) == 0)
+            mtime = st.st_mtim;
+        if (mtime.tv_sec != pathDirs[i].mtime.tv_sec || mtime.tv_nsec != pathDirs[i].mtime.tv_nsec)
+            return 0;
+    }
+    return 1;
+}
+
+// Find the cache bucket for name, or the empty bucket where it would go
+CommandEntry *findCommand(const char *name) {
+    unsigned int mask = commandCacheCapacity - 1;
+    unsigned int i = hashString(name) & mask;
+
+    while (commandCache[i].name != NULL && strcmp(commandCache[i].name, name) != 0) {
+        i = (i + 1) & mask;
+    }
+    return &commandCache[i];
+}
+
+// Resolve a command name to the executable posix_spawn should run, like execvp would, but
+// remember the answer so the child makes exactly one execve. Returns NULL if there is none.
+const char *resolveCommand(const char *name) {
+    // Names with a slash are used as they are
+    if (strchr(name, '/'))
+        return name;
+
+    const char *path = getenv("PATH");
+    if (path == NULL)
+        path = "/bin:/usr/bin";
+    if (cachedPath == NULL || strcmp(path, cachedPath) != 0) {
+        loadPathDirs(path);
+        flushCommandCache();
+    }
+
+    if (commandCacheCapacity == 0 || (commandCacheCount + 1) * 2 > commandCacheCapacity) {
+        CommandEntry *old = commandCache;
+        int oldCapacity = commandCacheCapacity;
+
+        commandCacheCapacity = oldCapacity ? oldCapacity * 2 : 64;
+        commandCache = calloc(commandCacheCapacity, sizeof(CommandEntry));
+        if (commandCache == NULL) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < oldCapacity; i++) {
+            if (old[i].name != NULL)
+                *findCommand(old[i].name) = old[i];
+        }
+        free(old);
+    }
+
+    CommandEntry *entry = findCommand(name);
+    if (entry->name != NULL) {
+        if (pathDirsUnchanged(entry->dirIndex)) {
+            entry->hits++;
+            commandCacheHits++;
+            return entry->path;
+        }
+        // A directory changed, start over with fresh modification times
+        loadPathDirs(path);
+        flushCommandCache();
+        entry = findCommand(name);
+    }
+
+    commandCacheMisses++;
+    for (int i = 0; i < pathDirCount; i++) {
+        char candidate[PATH_MAX];
+        struct stat st;
+
+        if (snprintf(candidate, sizeof(candidate), "%s/%s", pathDirs[i].dir, name) >= (int)sizeof(candidate))
+            continue;
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0) {
+            entry->name = strdup(name);
+            entry->path = strdup(candidate);
+            entry->dirIndex = i;
+            entry->hits = 1;
+            commandCacheCount++;
+            return entry->path;
+        }
+    }
+    return NULL;
+}
+
+// Built-in "hash [-r]": list the cached command paths, or forget them with -r
+void hashBuiltin(char *args[], int isBackground) {
+    (void)isBackground;
+
+    if (args[1] != NULL && strcmp(args[1], "-r") == 0) {
+        flushCommandCache();
+        return;
+    }
+    printf("hits\tcommand\n");
+    for (int i = 0; i < commandCacheCapacity; i++) {
+        if (commandCache[i].name != NULL)
+            printf("%d\t%s\n", commandCache[i].hits, commandCache[i].path);
+    }
+    printf("hw1shell: %ld hits, %ld misses\n", commandCacheHits, commandCacheMisses);
+}
+
+// Write text to a cgroup control file in dir, returns 0 on success
+int writeControlFile(const char *dir, const char *file, const char *text) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    ssize_t written = write(fd, text, strlen(text));
+    close(fd);
+    return written == (ssize_t)strlen(text) ? 0 : -1;
+}
+
+// Read key from a flat keyed control file such as cpu.stat, or 0 if it is not there
+long long readControlValue(const char *dir, const char *file, const char *key) {
+    char path[PATH_MAX];
+    char name[64];
+    long long value;
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return 0;
+    while (fscanf(f, "%63s %lld", name, &value) == 2) {
+        if (strcmp(name, key) == 0) {
+            fclose(f);
+            return value;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+// Find the cgroup v2 directory job cgroups are created in, $HW1SHELL_CGROUP_ROOT. It must be an
+// empty cgroup delegated to the user: the shell's own cgroup cannot be used, since a cgroup with
+// processes of its own may not enable controllers for its children. Returns 0 on success.
+int findCgroupBase(char *base, size_t size) {
+    const char *root = getenv("HW1SHELL_CGROUP_ROOT");
+
+    if (root == NULL || *root == '\0')
+        return -1;
+    snprintf(base, size, "%s", root);
+
+    // Only a cgroup v2 directory has cgroup.controllers
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/cgroup.controllers", base);
+    return access(path, F_OK);
+}
+
+// Create a leaf cgroup with the CPU and memory limits of a job. limits->cgroupDir is left NULL
+// when cgroup v2, or the cpu and memory controllers, are not available to the shell.
+void createJobCgroup(JobLimits *limits) {
+    char base[PATH_MAX], dir[PATH_MAX + 32], procs[PATH_MAX + 64], value[64];
+    int failed = 0;
+
+    limits->cgroupDir = NULL;
+    limits->cgroupProcsFd = -1;
+    if (findCgroupBase(base, sizeof(base)) != 0)
+        return;
+
+    // Already enabled in a prepared root, the limits below fail if this is refused
+    writeControlFile(base, "cgroup.subtree_control", "+cpu +memory");
+
+    snprintf(dir, sizeof(dir), "%s/hw1shell-%d-%d", base, getpid(), ++cgroupJobCount);
+    if (mkdir(dir, 0755) == -1)
+        return;
+
+    if (limits->cpus > 0) {
+        snprintf(value, sizeof(value), "%lld %d", (long long)(limits->cpus * CPU_PERIOD_USEC), CPU_PERIOD_USEC);
+        failed |= writeControlFile(dir, "cpu.max", value);
+    }
+    if (limits->memory > 0) {
+        snprintf(value, sizeof(value), "%lld", limits->memory);
+        failed |= writeControlFile(dir, "memory.max", value);
+    }
+
+    // Children join the cgroup by writing to this descriptor before they exec
+    snprintf(procs, sizeof(procs), "%s/cgroup.procs", dir);
+    if (!failed)
+        limits->cgroupProcsFd = open(procs, O_WRONLY | O_CLOEXEC);
+    if (limits->cgroupProcsFd == -1) {
+        rmdir(dir);
+        return;
+    }
+    limits->cgroupDir = strdup(dir);
+}
+
+// Remove the leaf cgroup of a finished job
+void removeJobCgroup(char *dir) {
+    if (dir == NULL)
+        return;
+    if (rmdir(dir) == -1)
+        printf("hw1shell: rmdir failed, errno is %d\n", errno);
+    free(dir);
+}
+
+// Pin the job to ceil(cpus) of the CPUs the shell may use, rotating through them so that
+// concurrent jobs land on different CPUs
+void pickCpus(JobLimits *limits) {
+    cpu_set_t allowed;
+    int wanted = (int)limits->cpus;
+
+    if (wanted < limits->cpus)
+        wanted++;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1 || wanted >= CPU_COUNT(&allowed))
+        return;
+
+    CPU_ZERO(&limits->affinity);
+    for (int picked = 0; picked < wanted; nextCpu = (nextCpu + 1) % CPU_SETSIZE) {
+        if (CPU_ISSET(nextCpu, &allowed)) {
+            CPU_SET(nextCpu, &limits->affinity);
+            picked++;
+        }
+    }
+    limits->useAffinity = 1;
+}
+
+// Runs in the child between fork and exec: join the job's cgroup, or limit the address space
+// instead, and pin the child to its CPUs. Returns 0 or an errno value.
+int applyLimits(JobLimits *limits) {
+    if (limits->cgroupDir != NULL) {
+        if (write(limits->cgroupProcsFd, "0", 1) != 1)
+            return errno;
+    } else if (limits->memory > 0) {
+        struct rlimit rl = { limits->memory, limits->memory };
+        if (setrlimit(RLIMIT_AS, &rl) == -1)
+            return errno;
+    }
+    if (limits->useAffinity && sched_setaffinity(0, sizeof(limits->affinity), &limits->affinity) == -1)
+        return errno;
+    return 0;
+}
+
+// Open file onto targetFd in a forked child, returns 0 or an errno value
+int openOnto(const char *file, int flags, int targetFd) {
+    int fd = open(file, flags, 0644);
+    if (fd == -1)
+        return errno;
+    if (fd != targetFd) {
+        if (dup2(fd, targetFd) == -1)
+            return errno;
+        close(fd);
+    }
+    return 0;
+}
+
+// Launch one stage with fork and exec, so that the child can apply its job limits first. An
+// error in the child is sent back over a close-on-exec pipe and returned like posix_spawn's.
+int forkStage(PipelineStage *stage, const char *path, int inputFd, int outputFd, JobLimits *limits, pid_t *pid) {
+    int errorPipe[2];
+    int err = 0;
+
+    if (pipe2(errorPipe, O_CLOEXEC) == -1)
+        return errno;
+
+    *pid = fork();
+    if (*pid == -1) {
+        err = errno;
+        close(errorPipe[0]);
+        close(errorPipe[1]);
+        return err;
+    }
+
+    if (*pid == 0) {
+        sigset_t emptyMask;
+        sigemptyset(&emptyMask);
+        sigprocmask(SIG_SETMASK, &emptyMask, NULL);
+
+        if (inputFd != -1 && dup2(inputFd, STDIN_FILENO) == -1)
+            err = errno;
+        if (!err && outputFd != -1 && dup2(outputFd, STDOUT_FILENO) == -1)
+            err = errno;
+        if (!err && stage->inputFile)
+            err = openOnto(stage->inputFile, O_RDONLY, STDIN_FILENO);
+        if (!err && stage->outputFile)
+            err = openOnto(stage->outputFile, O_WRONLY | O_CREAT | (stage->appendOutput ? O_APPEND : O_TRUNC),
+                           STDOUT_FILENO);
+        if (!err)
+            err = applyLimits(limits);
+        if (!err) {
+            execv(path, stage->argv);
+            err = errno;
+        }
+        if (write(errorPipe[1], &err, sizeof(err)) != sizeof(err))
+            _exit(127);
+        _exit(127);
+    }
+
+    // Reading end of file means the exec succeeded
+    close(errorPipe[1]);
+    ssize_t bytesRead;
+    while ((bytesRead = read(errorPipe[0], &err, sizeof(err))) == -1 && errno == EINTR) {
+        // Retry
+    }
+    close(errorPipe[0]);
+    if (bytesRead == sizeof(err)) {
+        waitpid(*pid, NULL, 0);
+        return err;
+    }
+    return 0;
+}
+
+// Launch one stage with posix_spawn. The child shares the parent's memory until it execs
+// (vfork semantics), so no page tables are copied. Stages with job limits are forked instead.
+// Returns 0 or an errno value.
+int spawnStage(PipelineStage *stage, int inputFd, int outputFd, JobLimits *limits, pid_t *pid) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    int err;
+
+    const char *path = resolveCommand(stage->argv[0]);
+    if (path == NULL)
+        return ENOENT;
+    if (limits != NULL)
+        return forkStage(stage, path, inputFd, outputFd, limits, pid);
+
+    posix_spawn_file_actions_init(&actions);
+    if (inputFd != -1)
+        posix_spawn_file_actions_adddup2(&actions, inputFd, STDIN_FILENO);
+    if (outputFd != -1)
+        posix_spawn_file_actions_adddup2(&actions, outputFd, STDOUT_FILENO);
+    // Explicit redirections win over the pipe, like in other shells
+    if (stage->inputFile)
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, stage->inputFile, O_RDONLY, 0);
+    if (stage->outputFile)
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, stage->outputFile,
+                                         O_WRONLY | O_CREAT | (stage->appendOutput ? O_APPEND : O_TRUNC), 0644);
+
+    // The shell blocks SIGCHLD for its signalfd, children start with an empty mask
+    sigset_t emptyMask;
+    sigemptyset(&emptyMask);
+    short flags = POSIX_SPAWN_SETSIGMASK;
+#ifdef POSIX_SPAWN_USEVFORK
+    flags |= POSIX_SPAWN_USEVFORK;
+#endif
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &emptyMask);
+    posix_spawnattr_setflags(&attr, flags);
+
+    err = posix_spawn(pid, path, &actions, &attr, stage->argv, environ);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    return err;
+}
+
+// Split input into a NULL-terminated argument array, unquoting the words in place. Words are
+// separated by blanks, '...' and "..." keep blanks inside a word, a backslash escapes the next
+// character and an unquoted # at the start of a word begins a comment. Unquoted operator words
+// point into operatorText. The array in *args grows as needed. Returns the argument count, or -1
+// if a quote is not closed.
+int tokenize(char *input, char ***args, int *capacity) {
+    char *read = input;
+    char *write = input;
+    int argCount = 0;
+
+    while (1) {
+        while (*read == ' ' || *read == '\t') {
+            read++;
+        }
+        if (*read == '\0' || *read == '#')
+            break;
+
+        if (argCount + 1 >= *capacity) {
+            *capacity = *capacity ? *capacity * 2 : 16;
+            *args = realloc(*args, *capacity * sizeof(char *));
+            if (*args == NULL) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        (*args)[argCount++] = write;
+
+        // Unquoting only ever shortens a word, so it is copied down over itself
+        char *word = write;
+        char quote = '\0';
+        int literal = 0;            // Quoted or escaped, so never an operator
+        while (*read != '\0' && (quote || (*read != ' ' && *read != '\t'))) {
+            if (quote == '\0' && (*read == '\'' || *read == '"')) {
+                quote = *read++;
+                literal = 1;
+            } else if (quote && *read == quote) {
+                quote = '\0';
+                read++;
+            } else if (*read == '\\' && quote != '\'' && read[1] != '\0' &&
+                       (quote == '\0' || read[1] == '"' || read[1] == '\\')) {
+                read++;
+                *write++ = *read++;
+                literal = 1;
             } else {
-                printf("hw1shell: too many background commands running\n");
+                *write++ = *read++;
             }
-        } else {
-            if (waitpid(pid, NULL, 0) == -1) {
-                printf("hw1shell: waitpid failed, errno is %d\n", errno);
+        }
+        if (quote)
+            return -1;
+        if (*read != '\0')
+            read++;
+        *write++ = '\0';
+
+        for (int op = 0; !literal && op < OP_COUNT; op++) {
+            if (strcmp(word, operatorText[op]) == 0) {
+                (*args)[argCount - 1] = operatorText[op];
+                break;
             }
         }
     }
+    if (argCount + 1 > *capacity) {
+        *capacity = 16;
+        *args = malloc(*capacity * sizeof(char *));
+        if (*args == NULL) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    (*args)[argCount] = NULL;  // Null-terminate the arguments array
+    return argCount;
+}
+
+// Start every stage of the pipeline in args, each one reading the pipe written by the previous one.
+// Returns the number of processes started, or -1 if the command could not be parsed.
+int launchPipeline(char *args[], pid_t pids[], JobLimits *limits) {
+    PipelineStage stages[MAX_PIPE_STAGES];
+    int stageCount = parsePipeline(args, stages);
+    int started = 0;
+    int inputFd = -1;
+
+    if (stageCount == -1) {
+        printf("hw1shell: invalid command\n");
+        return -1;
+    }
+
+    // Our own buffered output goes out before anything the children write
+    fflush(stdout);
+    for (int i = 0; i < stageCount; i++) {
+        int pipeFds[2] = { -1, -1 };
+
+        if (i < stageCount - 1 && pipe2(pipeFds, O_CLOEXEC) == -1) {
+            printf("hw1shell: pipe failed, errno is %d\n", errno);
+            break;
+        }
+
+        TRACE_BEGIN(spawnStart);
+        int err = spawnStage(&stages[i], inputFd, pipeFds[1], limits, &pids[started]);
+        TRACE_END(spawnStart, "spawn", "hw1");
+        if (err != 0) {
+            printf("hw1shell: invalid command\n");
+            printf("hw1shell: posix_spawn failed, errno is %d\n", err);
+        } else {
+            started++;
+        }
+
+        // The parent keeps only the read end of the newest pipe
+        if (inputFd != -1)
+            close(inputFd);
+        if (pipeFds[1] != -1)
+            close(pipeFds[1]);
+        inputFd = pipeFds[0];
+    }
+    if (inputFd != -1)
+        close(inputFd);
+
+    return started;
 }
 
-void printJobs() {
-    printf("PID\tCommand\n");
-    for (int i = 0; i < activeJobs; i++) {
-        printf("%d\t%s\n", bgJobs[i].pid, bgJobs[i].command);
+// Add the started processes to the job table so that they are reaped in the background. startTime
+// is taken before the first stage was spawned, so the job's elapsed time includes spawning.
+BackgroundJob *registerJob(pid_t pids[], int started, const char *command, JobKind kind,
+                           struct timespec startTime) {
+    BackgroundJob *job = allocateJob();
+
+    job->pid = pids[started - 1];
+    job->stagesRunning = started;
+    job->kind = kind;
+    job->exitStatus = 0;
+    memset(&job->usage, 0, sizeof(job->usage));
+    job->cgroupDir = NULL;
+    job->startTime = startTime;
+    for (int i = 0; i < started; i++) {
+        pidMapInsert(pids[i], job->id - 1);
     }
+    strncpy(job->command, command, CMD_MAX_LENGTH - 1);
+    job->command[CMD_MAX_LENGTH - 1] = '\0';
+
+    return job;
 }
 
-void reapFinishedJobs() {
+BackgroundJob *childExited(pid_t pid, int status, struct rusage *usage);
+
+// Run a command, with limits if it is not NULL. A foreground job is returned once all its stages
+// exited, the caller releases it.
+BackgroundJob *executeCommand(char *args[], int isBackground, JobLimits *limits) {
+    pid_t pids[MAX_PIPE_STAGES];
+    struct timespec startTime;
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+    int started = launchPipeline(args, pids, limits);
+
+    if (limits != NULL && limits->cgroupProcsFd != -1)
+        close(limits->cgroupProcsFd);
+    if (started <= 0) {
+        if (limits != NULL)
+            removeJobCgroup(limits->cgroupDir);
+        return NULL;
+    }
+
+    BackgroundJob *job = registerJob(pids, started, args[0], isBackground ? JOB_BACKGROUND : JOB_FOREGROUND,
+                                     startTime);
+    if (limits != NULL)
+        job->cgroupDir = limits->cgroupDir;
+    if (isBackground) {
+        printf("hw1shell: %d started\n", job->pid);
+        return NULL;
+    }
+
+    TRACE_BEGIN(waitStart);
+    for (int i = 0; i < started; i++) {
+        int status;
+        struct rusage usage;
+        if (wait4(pids[i], &status, 0, &usage) == -1) {
+            printf("hw1shell: waitpid failed, errno is %d\n", errno);
+            pidMapRemove(pids[i]);
+            job->stagesRunning--;
+            continue;
+        }
+        childExited(pids[i], status, &usage);
+    }
+    TRACE_END(waitStart, "wait", "hw1");
+    return job;
+}
+
+double secondsOf(struct timeval tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+double secondsBetween(struct timespec start, struct timespec end) {
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+// Turn a wait status into a shell-style exit code
+int exitCodeOf(int status) {
+    return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+}
+
+// Add the resource usage of one stage to its job's total
+void addUsage(struct rusage *total, struct rusage *usage) {
+    total->ru_utime.tv_sec += usage->ru_utime.tv_sec;
+    total->ru_utime.tv_usec += usage->ru_utime.tv_usec;
+    if (total->ru_utime.tv_usec >= 1000000) {
+        total->ru_utime.tv_sec++;
+        total->ru_utime.tv_usec -= 1000000;
+    }
+    total->ru_stime.tv_sec += usage->ru_stime.tv_sec;
+    total->ru_stime.tv_usec += usage->ru_stime.tv_usec;
+    if (total->ru_stime.tv_usec >= 1000000) {
+        total->ru_stime.tv_sec++;
+        total->ru_stime.tv_usec -= 1000000;
+    }
+    if (usage->ru_maxrss > total->ru_maxrss)
+        total->ru_maxrss = usage->ru_maxrss;
+    total->ru_nvcsw += usage->ru_nvcsw;
+    total->ru_nivcsw += usage->ru_nivcsw;
+    total->ru_minflt += usage->ru_minflt;
+    total->ru_majflt += usage->ru_majflt;
+}
+
+// Append a finished job to the CSV profile log
+void logProfile(BackgroundJob *job) {
+    if (profileLog == NULL)
+        return;
+
+    // Quotes in the command are doubled, as CSV requires
+    fprintf(profileLog, "%d,\"", job->pid);
+    for (const char *c = job->command; *c; c++) {
+        if (*c == '"')
+            fputc('"', profileLog);
+        fputc(*c, profileLog);
+    }
+    fprintf(profileLog, "\",%d,%.6f,%.6f,%.6f,%ld,%ld,%ld,%ld,%ld\n",
+            exitCodeOf(job->exitStatus), secondsBetween(job->startTime, job->endTime),
+            secondsOf(job->usage.ru_utime), secondsOf(job->usage.ru_stime), job->usage.ru_maxrss,
+            job->usage.ru_nvcsw, job->usage.ru_nivcsw, job->usage.ru_minflt, job->usage.ru_majflt);
+    fflush(profileLog);
+}
+
+// Open the CSV profile log named by $HW1SHELL_PROFILE, writing the header to a new file
+void openProfileLog() {
+    const char *path = getenv("HW1SHELL_PROFILE");
+    if (path == NULL || *path == '\0')
+        return;
+
+    profileLog = fopen(path, "a");
+    if (profileLog == NULL) {
+        printf("hw1shell: fopen failed, errno is %d\n", errno);
+        return;
+    }
+    if (ftell(profileLog) == 0) {
+        fprintf(profileLog, "pid,command,status,real_s,user_s,sys_s,maxrss_kb,voluntary_ctxsw,involuntary_ctxsw,"
+                            "minor_faults,major_faults\n");
+    }
+}
+
+// Print the resource usage of a finished job, used by the time built-in
+void printUsage(BackgroundJob *job) {
+    printf("hw1shell: real %.3fs, user %.3fs, sys %.3fs, max rss %ld KB, "
+           "%ld/%ld voluntary/involuntary context switches, %ld/%ld minor/major page faults\n",
+           secondsBetween(job->startTime, job->endTime), secondsOf(job->usage.ru_utime),
+           secondsOf(job->usage.ru_stime), job->usage.ru_maxrss, job->usage.ru_nvcsw, job->usage.ru_nivcsw,
+           job->usage.ru_minflt, job->usage.ru_majflt);
+}
+
+// Built-in "jobs [-l]": list the running background jobs. -l also lists the jobs that finished
+// since the last "jobs" with their resource usage, and both forms forget them.
+void printJobs(int longFormat) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (longFormat) {
+        printf("Job\tPID\tState\tReal\tUser\tSys\tMaxRSS\tCtxSw\tFaults\tCommand\n");
+    } else {
+        printf("PID\tCommand\n");
+    }
+
+    for (int i = 0; i < jobCapacity; i++) {
+        BackgroundJob *job = &bgJobs[i];
+        if (job->id == 0 || job->kind != JOB_BACKGROUND)
+            continue;
+
+        if (!longFormat) {
+            printf("%d\t%s\n", job->pid, job->command);
+        } else {
+            printf("%d\t%d\trunning\t%.3fs\t-\t-\t-\t-\t-\t%s\n", job->id, job->pid,
+                   secondsBetween(job->startTime, now), job->command);
+        }
+    }
+
+    for (int i = 0; longFormat && i < recentJobCount; i++) {
+        BackgroundJob *job = &recentJobs[(recentJobStart + i) % RECENT_JOB_COUNT];
+        printf("%d\t%d\tdone(%d)\t%.3fs\t%.3fs\t%.3fs\t%ldKB\t%ld\t%ld\t%s\n", job->id, job->pid,
+               exitCodeOf(job->exitStatus), secondsBetween(job->startTime, job->endTime),
+               secondsOf(job->usage.ru_utime), secondsOf(job->usage.ru_stime), job->usage.ru_maxrss,
+               job->usage.ru_nvcsw + job->usage.ru_nivcsw, job->usage.ru_minflt + job->usage.ru_majflt,
+               job->command);
+    }
+    recentJobCount = 0;
+}
+
+// Move a finished background job into recentJobs, dropping the oldest one when the ring is full,
+// and release its slot. Returns the copy.
+BackgroundJob *retireJob(BackgroundJob *job) {
+    if (recentJobCount == RECENT_JOB_COUNT) {
+        recentJobStart = (recentJobStart + 1) % RECENT_JOB_COUNT;
+        recentJobCount--;
+    }
+    BackgroundJob *recent = &recentJobs[(recentJobStart + recentJobCount++) % RECENT_JOB_COUNT];
+    *recent = *job;
+    releaseJob(job);
+    return recent;
+}
+
+// Account for an exited child. Returns its job if that job has now finished, or NULL. A finished
+// background job is returned from recentJobs, its slot is already released.
+BackgroundJob *childExited(pid_t pid, int status, struct rusage *usage) {
+    int slot = pidMapRemove(pid);
+    if (slot == -1)
+        return NULL;
+
+    BackgroundJob *job = &bgJobs[slot];
+    addUsage(&job->usage, usage);
+    if (pid == job->pid)
+        job->exitStatus = status;
+
+    // A pipeline is finished once its last running stage exits
+    if (--job->stagesRunning > 0)
+        return NULL;
+
+    clock_gettime(CLOCK_MONOTONIC, &job->endTime);
+    logProfile(job);
+    if (trace_enabled) {
+        trace_span("job", "hw1", job->startTime.tv_sec * 1000000000ULL + job->startTime.tv_nsec,
+                   job->endTime.tv_sec * 1000000000ULL + job->endTime.tv_nsec);
+    }
+
+    if (job->kind == JOB_PARALLEL) {
+        printf("hw1shell: %d exited with status %d (real %.3fs, user %.3fs, sys %.3fs): %s\n",
+               job->pid, exitCodeOf(job->exitStatus), secondsBetween(job->startTime, job->endTime),
+               secondsOf(job->usage.ru_utime), secondsOf(job->usage.ru_stime), job->command);
+    } else if (job->kind == JOB_BACKGROUND) {
+        printf("hw1shell: %d finished\n", job->pid);
+    }
+
+    // Report how hard the cgroup limits of a "run" job bit before removing its cgroup
+    if (job->cgroupDir != NULL) {
+        printf("hw1shell: %d throttled in %lld of %lld periods for %.3fs, hit memory.max %lld times, "
+               "%lld oom kills\n", job->pid, readControlValue(job->cgroupDir, "cpu.stat", "nr_throttled"),
+               readControlValue(job->cgroupDir, "cpu.stat", "nr_periods"),
+               readControlValue(job->cgroupDir, "cpu.stat", "throttled_usec") / 1e6,
+               readControlValue(job->cgroupDir, "memory.events", "max"),
+               readControlValue(job->cgroupDir, "memory.events", "oom_kill"));
+        removeJobCgroup(job->cgroupDir);
+        job->cgroupDir = NULL;
+    }
+    if (job->kind == JOB_BACKGROUND)
+        return retireJob(job);
+    return job;
+}
+
+// Reap every exited child, returns the number of background jobs that finished
+int reapFinishedJobs() {
     int status;
+    int finished = 0;
+    struct rusage usage;
     pid_t pid;
 
-    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-        printf("hw1shell: %d finished\n", pid);
+    while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+        // Finished background jobs leave the table, the last few are kept for "jobs -l"
+        if (childExited(pid, status, &usage))
+            finished++;
+    }
+    return finished;
+}
+
+// Built-in "parallel [-j N] [< cmdlist | cmdlist]": run every line of cmdlist as a command, keeping
+// up to N of them running at once (one per CPU by default). Job slots act as the scheduler's slots.
+void runParallel(char *args[]) {
+    long maxRunning = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *listFile = NULL;
 
-        for (int i = 0; i < activeJobs; i++) {
-            if (bgJobs[i].pid == pid) {
-                for (int j = i; j < activeJobs - 1; j++) {
-                    bgJobs[j] = bgJobs[j + 1];
-                }
-                activeJobs--;
+    for (int i = 1; args[i] != NULL; i++) {
+        if (strcmp(args[i], "-j") == 0 && args[i + 1] != NULL && atoi(args[i + 1]) > 0) {
+            maxRunning = atoi(args[++i]);
+        } else if (IS_OPERATOR(args[i], OP_INPUT) && args[i + 1] != NULL) {
+            listFile = args[++i];
+        } else if (listFile == NULL && args[i][0] != '-') {
+            listFile = args[i];
+        } else {
+            printf("hw1shell: invalid command\n");
+            return;
+        }
+    }
+    if (listFile == NULL || maxRunning < 1) {
+        printf("hw1shell: invalid command\n");
+        return;
+    }
+
+    FILE *list = fopen(listFile, "r");
+    if (list == NULL) {
+        printf("hw1shell: fopen failed, errno is %d\n", errno);
+        return;
+    }
+
+    struct timespec start, end;
+    char *line = NULL;
+    size_t lineCapacity = 0;
+    char **lineArgs = NULL;
+    int argCapacity = 0;
+    int running = 0, commands = 0, failed = 0, moreInput = 1;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (running > 0 || moreInput) {
+        // Fill every free slot
+        while (moreInput && running < maxRunning) {
+            if (getline(&line, &lineCapacity, list) == -1) {
+                moreInput = 0;
                 break;
             }
+            line[strcspn(line, "\n")] = '\0';
+
+            char command[CMD_MAX_LENGTH];
+            pid_t pids[MAX_PIPE_STAGES];
+            strncpy(command, line, sizeof(command) - 1);
+            command[sizeof(command) - 1] = '\0';
+
+            int argCount = tokenize(line, &lineArgs, &argCapacity);
+            if (argCount == 0)
+                continue;
+
+            commands++;
+            if (argCount == -1) {
+                printf("hw1shell: invalid command\n");
+                failed++;
+                continue;
+            }
+            struct timespec startTime;
+            clock_gettime(CLOCK_MONOTONIC, &startTime);
+            int started = launchPipeline(lineArgs, pids, NULL);
+            if (started <= 0) {
+                failed++;
+                continue;
+            }
+            registerJob(pids, started, command, JOB_PARALLEL, startTime);
+            running++;
+        }
+        if (running == 0)
+            continue;
+
+        // Start the next command as soon as one finishes
+        int status;
+        struct rusage usage;
+        pid_t pid = wait4(-1, &status, 0, &usage);
+        if (pid == -1) {
+            printf("hw1shell: wait4 failed, errno is %d\n", errno);
+            break;
+        }
+        BackgroundJob *job = childExited(pid, status, &usage);
+        if (job == NULL || job->kind != JOB_PARALLEL)
+            continue;
+        running--;
+        if (exitCodeOf(job->exitStatus) != 0)
+            failed++;
+        releaseJob(job);
+    }
+    fclose(list);
+    free(line);
+    free(lineArgs);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("hw1shell: parallel ran %d commands in %.3fs, %d failed\n", commands,
+           (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9, failed);
+}
+
+// Return the next line of input with its newline removed, or NULL at end of input. The line stays
+// valid until the next call. While waiting, children are reaped as soon as they exit.
+char *readInput() {
+    if (inputBuffer == NULL) {
+        inputCapacity = INPUT_CHUNK_SIZE * 2;
+        inputBuffer = malloc(inputCapacity + 1);
+        if (inputBuffer == NULL) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    while (1) {
+        char *newline = memchr(inputBuffer + inputStart, '\n', inputEnd - inputStart);
+        if (newline || (inputEof && inputEnd > inputStart)) {
+            char *line = inputBuffer + inputStart;
+            if (newline) {
+                *newline = '\0';
+                inputStart = newline - inputBuffer + 1;
+            } else {
+                inputBuffer[inputEnd] = '\0';  // Last line without a newline
+                inputStart = inputEnd;
+            }
+            return line;
+        }
+        if (inputEof)
+            return NULL;
+
+        // Make room behind the partial line, growing the buffer for very long lines
+        memmove(inputBuffer, inputBuffer + inputStart, inputEnd - inputStart);
+        inputEnd -= inputStart;
+        inputStart = 0;
+        if (inputCapacity - inputEnd < INPUT_CHUNK_SIZE) {
+            inputCapacity *= 2;
+            inputBuffer = realloc(inputBuffer, inputCapacity + 1);
+            if (inputBuffer == NULL) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        struct pollfd fds[2];
+        fds[0].fd = inputFd;
+        fds[0].events = POLLIN;
+        fds[1].fd = childSignalFd;
+        fds[1].events = POLLIN;
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+
+        if (fds[1].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            while (read(childSignalFd, &info, sizeof(info)) == sizeof(info)) {
+                // Drain the queued SIGCHLD notifications, one waitpid loop reaps them all
+            }
+            if (reapFinishedJobs() > 0 && interactive) {
+                printf("hw1shell$ ");
+                fflush(stdout);
+            }
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t bytesRead = read(inputFd, inputBuffer + inputEnd, inputCapacity - inputEnd);
+            if (bytesRead == -1 && errno != EINTR) {
+                perror("read");
+                exit(EXIT_FAILURE);
+            }
+            if (bytesRead == 0)
+                inputEof = 1;
+            if (bytesRead > 0)
+                inputEnd += bytesRead;
         }
     }
 }
 
 void cleanupOnExit() {
     int status;
-    while (waitpid(-1, &status, 0) > 0) {
-        // Wait for all child processes to finish
+    struct rusage usage;
+    pid_t pid;
+    while ((pid = wait4(-1, &status, 0, &usage)) > 0) {
+        // Wait for all child processes to finish, which also removes the cgroups of "run" jobs
+        childExited(pid, status, &usage);
     }
 }
 
-int main() {
+void exitBuiltin(char *args[], int isBackground) {
+    (void)args;
+    (void)isBackground;
+    cleanupOnExit();
+    printf("Exiting hw1shell...\n");
+    exit(EXIT_SUCCESS);
+}
+
+void cdBuiltin(char *args[], int isBackground) {
+    (void)isBackground;
+    if (chdir(args[1]) != 0) {
+        printf("hw1shell: invalid command\n");
+        printf("hw1shell: chdir failed, errno is %d\n", errno);
+    }
+}
+
+void jobsBuiltin(char *args[], int isBackground) {
+    (void)isBackground;
+    printJobs(args[1] != NULL && strcmp(args[1], "-l") == 0);
+}
+
+// Built-in "time cmd ...": run cmd in the foreground and print its resource usage
+void timeBuiltin(char *args[], int isBackground) {
+    if (args[1] == NULL || isBackground) {
+        printf("hw1shell: invalid command\n");
+        return;
+    }
+    BackgroundJob *job = executeCommand(args + 1, 0, NULL);
+    if (job) {
+        printUsage(job);
+        releaseJob(job);
+    }
+}
+
+void parallelBuiltin(char *args[], int isBackground) {
+    (void)isBackground;
+    runParallel(args);
+}
+
+// Parse a size in bytes with an optional K, M or G suffix, returns -1 if it is not one
+long long parseSize(const char *text) {
+    char *end;
+    long long size = strtoll(text, &end, 10);
+
+    if (end == text || size <= 0)
+        return -1;
+    if (*end == 'K' || *end == 'k') {
+        size <<= 10;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        size <<= 20;
+        end++;
+    } else if (*end == 'G' || *end == 'g') {
+        size <<= 30;
+        end++;
+    }
+    return *end == '\0' ? size : -1;
+}
+
+// Built-in "run [--cpus N] [--mem SIZE] cmd ...": run cmd with at most N CPUs of bandwidth
+// (fractions allowed) and SIZE bytes of memory. Both are enforced by a cgroup v2 leaf created under
+// $HW1SHELL_CGROUP_ROOT. Without it memory is limited through RLIMIT_AS and --cpus only pins the
+// job to ceil(N) CPUs, which does nothing when N covers every CPU the shell may use.
+void runBuiltin(char *args[], int isBackground) {
+    static int warnedNoCgroup = 0;
+    JobLimits limits;
+    int i = 1, valid = 1;
+
+    memset(&limits, 0, sizeof(limits));
+    for (; valid && args[i] != NULL && strncmp(args[i], "--", 2) == 0; i++) {
+        char *end;
+        if (strcmp(args[i], "--cpus") == 0 && args[i + 1] != NULL) {
+            limits.cpus = strtod(args[++i], &end);
+            valid = *end == '\0' && limits.cpus > 0;
+        } else if (strcmp(args[i], "--mem") == 0 && args[i + 1] != NULL) {
+            limits.memory = parseSize(args[++i]);
+            valid = limits.memory != -1;
+        } else {
+            valid = 0;
+        }
+    }
+    if (!valid || args[i] == NULL) {
+        printf("hw1shell: invalid command\n");
+        return;
+    }
+
+    if (limits.cpus > 0)
+        pickCpus(&limits);
+    createJobCgroup(&limits);
+    if (limits.cgroupDir == NULL && !warnedNoCgroup) {
+        printf("hw1shell: no cgroup v2 (set HW1SHELL_CGROUP_ROOT to a delegated cgroup), --cpus is not enforced "
+               "beyond pinning to fewer CPUs and --mem uses RLIMIT_AS\n");
+        warnedNoCgroup = 1;
+    }
+
+    BackgroundJob *job = executeCommand(args + i, isBackground, &limits);
+    if (job)
+        releaseJob(job);
+}
+
+// Resources known to the ulimit built-in, with the unit their values are given in
+typedef struct {
+    char option;
+    int resource;
+    rlim_t unit;
+    const char *description;
+} ResourceLimit;
+
+ResourceLimit resourceLimits[] = {
+    { 'c', RLIMIT_CORE, 1024, "core file size (KB)" },
+    { 'd', RLIMIT_DATA, 1024, "data segment size (KB)" },
+    { 'f', RLIMIT_FSIZE, 1024, "file size (KB)" },
+    { 'n', RLIMIT_NOFILE, 1, "open files" },
+    { 's', RLIMIT_STACK, 1024, "stack size (KB)" },
+    { 't', RLIMIT_CPU, 1, "cpu time (seconds)" },
+    { 'u', RLIMIT_NPROC, 1, "max user processes" },
+    { 'v', RLIMIT_AS, 1024, "virtual memory (KB)" },
+};
+
+#define RESOURCE_LIMIT_COUNT (int)(sizeof(resourceLimits) / sizeof(resourceLimits[0]))
+
+void printLimit(ResourceLimit *limit, int hard, int withDescription) {
+    struct rlimit rl;
+    getrlimit(limit->resource, &rl);
+    rlim_t value = hard ? rl.rlim_max : rl.rlim_cur;
+
+    if (withDescription)
+        printf("%-24s(-%c) ", limit->description, limit->option);
+    if (value == RLIM_INFINITY) {
+        printf("unlimited\n");
+    } else {
+        printf("%llu\n", (unsigned long long)(value / limit->unit));
+    }
+}
+
+// Built-in "ulimit [-H] [-a | -c|-d|-f|-n|-s|-t|-u|-v [limit]]": show or set a resource limit of
+// the shell, which every job it starts inherits. Soft limits unless -H is given, -f by default.
+void ulimitBuiltin(char *args[], int isBackground) {
+    (void)isBackground;
+    ResourceLimit *limit = &resourceLimits[2];
+    char *value = NULL;
+    int hard = 0, all = 0;
+
+    for (int i = 1; args[i] != NULL; i++) {
+        if (args[i][0] == '-' && args[i][1] != '\0' && args[i][2] == '\0') {
+            char option = args[i][1];
+            int found = 0;
+
+            for (int j = 0; j < RESOURCE_LIMIT_COUNT; j++) {
+                if (resourceLimits[j].option == option) {
+                    limit = &resourceLimits[j];
+                    found = 1;
+                }
+            }
+            if (option == 'H') {
+                hard = 1;
+            } else if (option == 'a') {
+                all = 1;
+            } else if (!found) {
+                printf("hw1shell: invalid command\n");
+                return;
+            }
+        } else if (value == NULL) {
+            value = args[i];
+        } else {
+            printf("hw1shell: invalid command\n");
+            return;
+        }
+    }
+
+    if (all) {
+        for (int j = 0; j < RESOURCE_LIMIT_COUNT; j++) {
+            printLimit(&resourceLimits[j], hard, 1);
+        }
+        return;
+    }
+    if (value == NULL) {
+        printLimit(limit, hard, 0);
+        return;
+    }
+
+    rlim_t newValue = RLIM_INFINITY;
+    if (strcmp(value, "unlimited") != 0) {
+        char *end;
+        unsigned long long number = strtoull(value, &end, 10);
+        if (end == value || *end != '\0') {
+            printf("hw1shell: invalid command\n");
+            return;
+        }
+        newValue = number * limit->unit;
+    }
+
+    struct rlimit rl;
+    getrlimit(limit->resource, &rl);
+    if (hard) {
+        rl.rlim_max = newValue;
+        if (rl.rlim_cur > newValue)
+            rl.rlim_cur = newValue;
+    } else {
+        rl.rlim_cur = newValue;
+    }
+    if (setrlimit(limit->resource, &rl) == -1)
+        printf("hw1shell: setrlimit failed, errno is %d\n", errno);
+}
+
+Builtin builtins[] = {
+    { "exit", exitBuiltin },
+    { "cd", cdBuiltin },
+    { "jobs", jobsBuiltin },
+    { "time", timeBuiltin },
+    { "parallel", parallelBuiltin },
+    { "hash", hashBuiltin },
+    { "ulimit", ulimitBuiltin },
+    { "run", runBuiltin },
+};
+
+// Built-ins indexed by name hash, so dispatch costs one hash and one strcmp
+#define BUILTIN_TABLE_SIZE 16
+Builtin *builtinTable[BUILTIN_TABLE_SIZE];
+
+void initBuiltins() {
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        unsigned int slot = hashString(builtins[i].name) & (BUILTIN_TABLE_SIZE - 1);
+        while (builtinTable[slot] != NULL) {
+            slot = (slot + 1) & (BUILTIN_TABLE_SIZE - 1);
+        }
+        builtinTable[slot] = &builtins[i];
+    }
+}
+
+Builtin *findBuiltin(const char *name) {
+    unsigned int slot = hashString(name) & (BUILTIN_TABLE_SIZE - 1);
+    while (builtinTable[slot] != NULL) {
+        if (strcmp(builtinTable[slot]->name, name) == 0)
+            return builtinTable[slot];
+        slot = (slot + 1) & (BUILTIN_TABLE_SIZE - 1);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    // "hw1shell script" runs the commands in script, otherwise they are read from stdin
+    if (argc > 1) {
+        inputFd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (inputFd == -1) {
+            printf("hw1shell: open failed, errno is %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+    }
+    interactive = isatty(inputFd);
+
+
+    // Children are reaped through a signalfd that is polled together with stdin
+    sigset_t childMask;
+    sigemptyset(&childMask);
+    sigaddset(&childMask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &childMask, NULL) == -1) {
+        perror("sigprocmask");
+        exit(EXIT_FAILURE);
+    }
+    childSignalFd = signalfd(-1, &childMask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (childSignalFd == -1) {
+        perror("signalfd");
+        exit(EXIT_FAILURE);
+    }
+    openProfileLog();
+    initBuiltins();
+    trace_init("hw1shell");
+
+    char **args = NULL;
+    int argCapacity = 0;
+
     while (1) {
         reapFinishedJobs();
-        char input[CMD_MAX_LENGTH];
-        char *args[ARG_MAX_COUNT];
 
         // Display the shell prompt
-        printf("hw1shell$ ");
-        fflush(stdout);
-
-        // Read user input
-        if (fgets(input, sizeof(input), stdin) == NULL) {
-            perror("fgets");
-            exit(EXIT_FAILURE);
+        if (interactive) {
+            printf("hw1shell$ ");
+            fflush(stdout);
         }
 
-        // Trim newline character
-        input[strcspn(input, "\n")] = '\0';
+        // Read user input, stopping once every child has finished at the end of it
+        char *input = readInput();
+        if (input == NULL) {
+            cleanupOnExit();
+            if (interactive)
+                printf("\n");
+            exit(EXIT_SUCCESS);
+        }
 
-        if (strlen(input) == 0) {
+        if (input[0] == '\0') {
             continue;  // Skip empty commands
         }
 
         // Tokenize input into arguments
-        char *token = strtok(input, " ");
-        int argCount = 0;
-
-        while (token != NULL && argCount < ARG_MAX_COUNT - 1) {
-            args[argCount++] = token;
-            token = strtok(NULL, " ");
+        int argCount = tokenize(input, &args, &argCapacity);
+        if (argCount == -1) {
+            printf("hw1shell: invalid command\n");
+            continue;
+        }
+        if (argCount == 0) {
+            continue;
         }
-        args[argCount] = NULL;  // Null-terminate the arguments array
 
-        if (strcmp(args[0], "&") == 0) {
+        if (IS_OPERATOR(args[0], OP_BACKGROUND)) {
             printf("hw1shell: invalid command\n");
             continue;
         }
 
         // Check for background command
         int isBackground = 0;
-        if (argCount > 0 && strcmp(args[argCount - 1], "&") == 0) {
+        if (argCount > 0 && IS_OPERATOR(args[argCount - 1], OP_BACKGROUND)) {
             isBackground = 1;
             args[argCount - 1] = NULL;  // Remove "&" from arguments
         }
@@ -134,20 +1563,16 @@ int main() {
         reapFinishedJobs();
 
         // Internal commands
-        if (strcmp(args[0], "exit") == 0) {
-            cleanupOnExit();
-            printf("Exiting hw1shell...\n");
-            exit(EXIT_SUCCESS);
-        } else if (strcmp(args[0], "cd") == 0) {
-            if (chdir(args[1]) != 0) {
-                printf("hw1shell: invalid command\n");
-                printf("hw1shell: chdir failed, errno is %d\n", errno);
-            }
-        } else if (strcmp(args[0], "jobs") == 0) {
-            printJobs();
+        TRACE_BEGIN(commandStart);
+        Builtin *builtin = findBuiltin(args[0]);
+        if (builtin) {
+            builtin->run(args, isBackground);
         } else {
-            executeCommand(args, isBackground);
+            BackgroundJob *job = executeCommand(args, isBackground, NULL);
+            if (job)
+                releaseJob(job);
         }
+        TRACE_END(commandStart, "command", "hw1");
 
         reapFinishedJobs();
     }
@@ -0,0 +1,24 @@
+#!/bin/sh
+# Benchmark hw2: push many tiny jobs through the work queue, so that the queue and its lock
+# dominate. Prints "metric: value" lines, collected by "make bench" at the top level.
+set -e
+cd "$(dirname "$0")"
+JOBS=${JOBS:-20000}
+THREADS=${THREADS:-8}
+COUNTERS=8
+hw2=$(pwd)/hw2
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+seq 0 $((JOBS - 1)) | awk -v counters=$COUNTERS '{ print "worker increment " $1 % counters }' > "$work/cmdfile.txt"
+echo "dispatcher wait" >> "$work/cmdfile.txt"
+
+cd "$work"
+"$hw2" cmdfile.txt "$THREADS" "$COUNTERS" 0
+total=$(awk '/^total running time/ { print $4 }' stats.txt)
+echo "hw2 jobs: $JOBS on $THREADS threads"
+echo "hw2 total running time ms: $total"
+echo "hw2 average turnaround ms: $(awk '/^average job turnaround/ { print $5 }' stats.txt)"
+echo "hw2 jobs/s: $(awk "BEGIN { printf \"%.0f\", $JOBS / ($total > 0 ? $total : 1) * 1000 }")"
+# Present when built with -DLOCK_PROFILE
+grep '^&work_queue.mutex' stats.txt | sed 's/^/hw2 lock /' || true
@@ -7,6 +7,9 @@
 #include <sys/time.h>
 #include <stdint.h>
 
+#include "../common/lockprof.h"
+#include "../common/trace.h"
+
 #define MAX_COMMAND_LENGTH 1024
 #define MAX_COUNTERS 100
 #define MAX_THREADS 4096
@@ -17,6 +20,7 @@ typedef struct {
     char command[MAX_COMMAND_LENGTH];
     long long start_time; // Start time of the job
     long long end_time;   // End time of the job
+    uint64_t enqueue_ns;  // When the job entered the queue, for tracing
 } Command;
 
 // Work queue structure
@@ -84,6 +88,9 @@ int main(int argc, char *argv[]) {
     int num_counters = atoi(argv[3]);
     log_enabled = atoi(argv[4]);
 
+    trace_init("hw2");
+    trace_thread_name("dispatcher");
+
     // Initialize work queue
     initialize_work_queue(); 
     // Create counter files
@@ -137,9 +144,10 @@ int main(int argc, char *argv[]) {
         }
     }
     fclose(file);
+    MUTEX_LOCK(&work_queue.mutex);
     work_queue.done=1;
     pthread_cond_signal(&work_queue.cond_empty);
-    pthread_mutex_unlock(&work_queue.mutex);
+    MUTEX_UNLOCK(&work_queue.mutex);
 
     // Wait for all pending background commands to complete
     for (int i=0;i<num_threads;i++)
@@ -161,6 +169,8 @@ int main(int argc, char *argv[]) {
     fprintf(stats_file, "min job turnaround time: %lld milliseconds\n", min_turnaround_time);
     fprintf(stats_file, "average job turnaround time: %f milliseconds\n", (double)sum_turnaround_time / (double)(work_queue.counter_jobs));
     fprintf(stats_file, "max job turnaround time: %lld milliseconds\n", max_turnaround_time);
+    // Only prints anything when built with -DLOCK_PROFILE
+    lockprof_report(stats_file);
     fclose(stats_file);
 
 
@@ -178,6 +188,9 @@ void* worker_thread(void* arg) {
     Command *command;
     char log_filename[20];
     snprintf(log_filename, sizeof(log_filename), "thread%d.txt", thread_id);
+    char thread_name[32];
+    snprintf(thread_name, sizeof(thread_name), "worker %d", thread_id);
+    trace_thread_name(thread_name);
     FILE* thread_log = NULL;
     if (log_enabled) {
         thread_log = fopen(log_filename, "w");
@@ -202,6 +215,8 @@ void* worker_thread(void* arg) {
         }
 
 
+        TRACE_BEGIN(execute_start);
+
         // Tokenize the command line
         char* token;
         strcpy(copy_command,command->command);
@@ -240,8 +255,10 @@ void* worker_thread(void* arg) {
                 }
             }
         }
+        TRACE_END(execute_start, "execute", "hw2");
+
                 // Update statistics
-        pthread_mutex_lock(&work_queue.mutex);
+        MUTEX_LOCK(&work_queue.mutex);
         command->end_time = get_current_time();
         turnaround_time = command->end_time - command->start_time;
         sum_turnaround_time += turnaround_time;
@@ -251,7 +268,7 @@ void* worker_thread(void* arg) {
         if (turnaround_time > max_turnaround_time) {
             max_turnaround_time = turnaround_time;
         }
-        pthread_mutex_unlock(&work_queue.mutex);
+        MUTEX_UNLOCK(&work_queue.mutex);
 
              // Log the end of the job
         if (log_enabled) {
@@ -300,16 +317,18 @@ void initialize_work_queue() {
 
 // Enqueue work into the queue
 void enqueue_work(Command *command) {
-    pthread_mutex_lock(&work_queue.mutex);
+    TRACE_BEGIN(enqueue_start);
+    MUTEX_LOCK(&work_queue.mutex);
     while (work_queue.size >= work_queue.capacity) {
-        pthread_cond_wait(&work_queue.cond_full, &work_queue.mutex);
+        COND_WAIT(&work_queue.cond_full, &work_queue.mutex);
     }
     work_queue.rear = (work_queue.rear + 1) % work_queue.capacity;
     work_queue.commands[work_queue.rear] = command;
     work_queue.size++;
     work_queue.counter_jobs++;
     pthread_cond_signal(&work_queue.cond_empty);
-    pthread_mutex_unlock(&work_queue.mutex);
+    MUTEX_UNLOCK(&work_queue.mutex);
+    TRACE_END(enqueue_start, "enqueue", "hw2");
 }
 
 // Dequeue work from the queue
@@ -317,10 +336,11 @@ Command* dequeue_work() {
     Command *command;
     command=NULL;
 
-    pthread_mutex_lock(&work_queue.mutex);
+    TRACE_BEGIN(dequeue_start);
+    MUTEX_LOCK(&work_queue.mutex);
     while (work_queue.size <= 0 && !work_queue.done ) {
         pthread_cond_broadcast(&work_queue.cond_wait);
-        pthread_cond_wait(&work_queue.cond_empty, &work_queue.mutex);
+        COND_WAIT(&work_queue.cond_empty, &work_queue.mutex);
 
     }
     if (work_queue.size>0)
@@ -329,15 +349,21 @@ Command* dequeue_work() {
         work_queue.front = (work_queue.front + 1) % work_queue.capacity;
         work_queue.size--;
         pthread_cond_signal(&work_queue.cond_full);
-        pthread_mutex_unlock(&work_queue.mutex);
+        MUTEX_UNLOCK(&work_queue.mutex);
 
     }
     else
     // no more work, wake up stuck threads
     {
         pthread_cond_signal(&work_queue.cond_empty);
-        pthread_mutex_unlock(&work_queue.mutex);
+        MUTEX_UNLOCK(&work_queue.mutex);
+
+    }
+    TRACE_END(dequeue_start, "dequeue", "hw2");
 
+    // Time the job spent waiting in the queue
+    if (trace_enabled && command != NULL) {
+        trace_span("queued", "hw2", command->enqueue_ns, trace_now_ns());
     }
 
     return command;
@@ -359,11 +385,13 @@ void parse_dispatcher_command(char* line) {
         else 
             printf("invalid command\n");
     } else if (strcmp(command, "wait") == 0) {
-        pthread_mutex_lock(&work_queue.mutex);
+        TRACE_BEGIN(wait_start);
+        MUTEX_LOCK(&work_queue.mutex);
         while (work_queue.size > 0 ) {
-            pthread_cond_wait(&work_queue.cond_wait, &work_queue.mutex);
+            COND_WAIT(&work_queue.cond_wait, &work_queue.mutex);
         }
-        pthread_mutex_unlock(&work_queue.mutex);
+        MUTEX_UNLOCK(&work_queue.mutex);
+        TRACE_END(wait_start, "dispatcher_wait", "hw2");
         
     } 
 
@@ -378,6 +406,7 @@ void parse_worker_job(char* line,long long reading_line_time) {
     // Enqueue the worker job
     Command *command=(Command *)malloc(sizeof(Command));
     command->start_time=reading_line_time;
+    command->enqueue_ns = trace_enabled ? trace_now_ns() : 0;
     strcpy(command->command, job);
     enqueue_work(command);
 }
@@ -0,0 +1,178 @@
+#!/bin/sh
+# Benchmark hw3server:
+#   fan-out      CLIENTS clients each send MESSAGES messages at once and every message is fanned
+#                out to all the others, for each batching setting in BATCHING. Reports throughput,
+#                p50/p99 delivery latency and how many writes each delivered message took, which
+#                together give the throughput/latency tradeoff of -T and -S
+#   connections  CONNECTORS processes open and reset connections as fast as they can for
+#                CONNECT_SECONDS, with one acceptor (-A 1) and with four (-A 4). The rate is the
+#                server's own count of accepted sockets, so it measures accept capacity rather than
+#                the handshake of a single client
+# Prints "metric: value" lines, collected by "make bench" at the top level. Needs python3 for the
+# load generator.
+set -e
+cd "$(dirname "$0")"
+PORT=${PORT:-24680}
+CLIENTS=${CLIENTS:-8}
+MESSAGES=${MESSAGES:-2000}
+CONNECTORS=${CONNECTORS:-16}
+CONNECT_SECONDS=${CONNECT_SECONDS:-2}
+BATCHING=${BATCHING:-"-T 0,-T 200 -S 4096,-T 1000 -S 16384,-T 5000 -S 65536"}
+work=$(mktemp -d)
+server=
+trap '[ -z "$server" ] || kill -INT $server 2> /dev/null || true; rm -rf "$work"' EXIT
+
+# Start the server with the given options on the next port, its output goes to $work/server.log
+start_server() {
+    PORT=$((PORT + 1))
+    ./hw3server "$@" "$PORT" > "$work/server.log" 2>&1 &
+    server=$!
+    sleep 0.3
+}
+
+# Stop the server and wait for its shutdown report
+stop_server() {
+    kill -INT $server
+    wait $server || true
+    server=
+}
+
+cat > "$work/load.py" <<'PYTHON'
+import multiprocessing, re, socket, struct, sys, threading, time
+
+mode, port = sys.argv[1], int(sys.argv[2])
+
+def fanout(label, clients, messages):
+    # Each payload carries its send time in microseconds, the receiver matches them in the stream
+    # however TCP and the server split and join the messages
+    stamp = re.compile(rb"<(\d{16})>")
+    received = [0] * clients
+    latencies = [[] for _ in range(clients)]
+    last_data = [0.0] * clients
+    sockets = []
+    for i in range(clients):
+        s = socket.create_connection(("127.0.0.1", port))
+        s.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        s.sendall(b"bench%d" % i)
+        sockets.append(s)
+        time.sleep(0.05)
+    time.sleep(0.2)
+    for s in sockets:   # Join notices and history replay
+        s.setblocking(False)
+        try:
+            while s.recv(65536):
+                pass
+        except BlockingIOError:
+            pass
+        s.setblocking(True)
+
+    def receive(i):
+        expected = (clients - 1) * messages
+        pending = b""
+        sockets[i].settimeout(2)
+        try:
+            while received[i] < expected:
+                data = sockets[i].recv(65536)
+                if not data:
+                    break
+                now = time.monotonic_ns() // 1000
+                pending += data
+                end = 0
+                for match in stamp.finditer(pending):
+                    latencies[i].append(now - int(match.group(1)))
+                    end = match.end()
+                received[i] = len(latencies[i])
+                pending = pending[max(end, len(pending) - 17):]
+                last_data[i] = time.monotonic()
+        except socket.timeout:
+            pass    # Messages the server dropped for a slow reader never arrive
+
+    def send(i):
+        for _ in range(messages):
+            sockets[i].sendall(b"<%016d>" % (time.monotonic_ns() // 1000))
+
+    start = time.monotonic()
+    receivers = [threading.Thread(target=receive, args=(i,)) for i in range(clients)]
+    senders = [threading.Thread(target=send, args=(i,)) for i in range(clients)]
+    for t in receivers + senders:
+        t.start()
+    for t in receivers + senders:
+        t.join()
+    # The receive timeout is not part of the run
+    elapsed = max(max(last_data) - start, 1e-9)
+
+    delivered = sum(received)
+    all_latencies = sorted(l for per_client in latencies for l in per_client) or [0]
+    percentile = lambda p: all_latencies[min(len(all_latencies) - 1, int(len(all_latencies) * p))] / 1000
+    print("hw3 %s clients: %d sending %d messages each" % (label, clients, messages))
+    print("hw3 %s delivered: %d of %d" % (label, delivered, clients * (clients - 1) * messages))
+    print("hw3 %s deliveries/s: %.0f" % (label, delivered / elapsed))
+    print("hw3 %s latency p50 ms: %.3f" % (label, percentile(0.50)))
+    print("hw3 %s latency p99 ms: %.3f" % (label, percentile(0.99)))
+    for s in sockets:
+        s.close()
+
+def connections(label, connectors, seconds):
+    # Separate processes, so the generator is not limited by one interpreter. Connections are reset
+    # instead of closed so that the ports do not run out in TIME_WAIT.
+    linger = struct.pack("ii", 1, 0)
+    connected = multiprocessing.Value("l", 0)
+
+    def connect():
+        count = 0
+        deadline = time.monotonic() + seconds
+        while time.monotonic() < deadline:
+            s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+            s.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER, linger)
+            try:
+                s.connect(("127.0.0.1", port))
+                count += 1
+            except OSError:
+                pass
+            s.close()
+        with connected.get_lock():
+            connected.value += count
+
+    processes = [multiprocessing.Process(target=connect) for _ in range(connectors)]
+    for p in processes:
+        p.start()
+    for p in processes:
+        p.join()
+    print("hw3 %s connectors: %d for %gs" % (label, connectors, seconds))
+    print("hw3 %s connects/s: %.0f" % (label, connected.value / seconds))
+
+if mode == "fanout":
+    fanout(sys.argv[3], int(sys.argv[4]), int(sys.argv[5]))
+else:
+    connections(sys.argv[3], int(sys.argv[4]), float(sys.argv[5]))
+PYTHON
+
+# Writes per delivered message, from the server's "Delivery: N messages in M writes" line
+writes_per_message() {
+    awk '/^Delivery:/ { printf "%.3f", $5 / ($2 ? $2 : 1) }' "$work/server.log"
+}
+
+# Split BATCHING at commas into the positional parameters
+old_ifs=$IFS
+IFS=,
+set -- $BATCHING
+IFS=$old_ifs
+for batching in "$@"; do
+    start_server $batching
+    python3 "$work/load.py" fanout "$PORT" "fan-out ($batching)" "$CLIENTS" "$MESSAGES"
+    stop_server
+    echo "hw3 fan-out ($batching) writes/message: $(writes_per_message)"
+done
+
+# Connections accepted per second, from the server's "Acceptor N accepted M connections" lines
+accepts_per_second() {
+    awk -v seconds="$CONNECT_SECONDS" '/^Acceptor .* accepted/ { total += $4 }
+        END { printf "%.0f", total / seconds }' "$work/server.log"
+}
+
+for acceptors in 1 4; do
+    start_server -A "$acceptors"
+    python3 "$work/load.py" connections "$PORT" "connections (-A $acceptors)" "$CONNECTORS" "$CONNECT_SECONDS"
+    stop_server
+    echo "hw3 connections (-A $acceptors) accepts/s: $(accepts_per_second)"
+done
@@ -5,20 +5,32 @@
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <zlib.h>
 
 #define MAX_LENGTH 256
 #define BUFFER_SIZE 1024
 
 volatile bool running = true;
+bool compressed = false;            // Server messages arrive as a deflate stream
 
 // Function prototypes
 void *receive_messages(void *socket);
 
 int main(int argc, char *argv[]) {
-    if (argc != 4) {
-        printf("Usage: %s <server_address> <port> <username>\n", argv[0]);
+    int opt;
+    while ((opt = getopt(argc, argv, "z")) != -1) {
+        if (opt == 'z') {
+            compressed = true;
+        } else {
+            printf("Usage: %s [-z] <server_address> <port> <username>\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (argc - optind != 3) {
+        printf("Usage: %s [-z] <server_address> <port> <username>\n", argv[0]);
         return EXIT_FAILURE;
     }
+    argv += optind - 1;  // argv[1..3] are the positional arguments from here on
 
     if (strlen(argv[3]) >= MAX_LENGTH) {
         printf("Error: Username must be less than %d characters.\n", MAX_LENGTH);
@@ -51,8 +63,10 @@ int main(int argc, char *argv[]) {
         return EXIT_FAILURE;
     }
 
-    // Send username
-    if (send(client_socket, argv[3], strlen(argv[3]), 0) == -1) {
+    // Send username, optionally followed by a request for a compressed stream
+    char handshake[MAX_LENGTH + 32];
+    snprintf(handshake, sizeof(handshake), "%s%s", argv[3], compressed ? "\ncompress=deflate" : "");
+    if (send(client_socket, handshake, strlen(handshake), 0) == -1) {
         perror("Failed to send username");
         close(client_socket);
         return EXIT_FAILURE;
@@ -100,15 +114,56 @@ int main(int argc, char *argv[]) {
     return 0;
 }
 
+// Inflate a chunk of the server's stream and print it, returns -1 if the stream is corrupt
+int print_compressed(z_stream *stream, char *data, int length) {
+    char output[BUFFER_SIZE * 4];
+
+    stream->next_in = (unsigned char *)data;
+    stream->avail_in = length;
+    do {
+        stream->next_out = (unsigned char *)output;
+        stream->avail_out = sizeof(output);
+        int result = inflate(stream, Z_SYNC_FLUSH);
+        if (result != Z_OK && result != Z_BUF_ERROR) {
+            return -1;
+        }
+        fwrite(output, 1, sizeof(output) - stream->avail_out, stdout);
+    } while (stream->avail_out == 0);
+    fflush(stdout);
+
+    return 0;
+}
+
 // Thread function for receiving messages from the server
 void *receive_messages(void *socket) {
     int server_socket = *(int *)socket;
     char buffer[BUFFER_SIZE];
     int bytes_received;
+    z_stream stream;
+
+    if (compressed) {
+        memset(&stream, 0, sizeof(stream));
+        if (inflateInit(&stream) != Z_OK) {
+            printf("Failed to initialize decompression\n");
+            running = false;
+            pthread_exit(NULL);
+        }
+    }
 
     while (running) {
         bytes_received = recv(server_socket, buffer, sizeof(buffer) - 1, 0);
-        if (bytes_received > 0) {
+        // A deflate stream starts with a zlib header byte of 0x78. Anything else is a plain text refusal
+        // the server sent before it got to negotiate compression, like "Server is busy".
+        if (bytes_received > 0 && compressed && stream.total_in == 0 && (unsigned char)buffer[0] != 0x78) {
+            inflateEnd(&stream);
+            compressed = false;
+        }
+        if (bytes_received > 0 && compressed) {
+            if (print_compressed(&stream, buffer, bytes_received) == -1) {
+                printf("Corrupt message stream from server.\n");
+                break;
+            }
+        } else if (bytes_received > 0) {
             buffer[bytes_received] = '\0';  // Null-terminate the received message
             printf("%s", buffer);
         } else if (bytes_received == 0) {
@@ -120,6 +175,7 @@ void *receive_messages(void *socket) {
         }
     }
 
+    if (compressed) inflateEnd(&stream);
     running = false;  // Ensure the main thread knows to exit
     pthread_exit(NULL);
 }
@@ -1,31 +1,148 @@
+#define _GNU_SOURCE  // accept4, pipe2, ppoll
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdatomic.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <zlib.h>
+
+#include "../common/lockprof.h"
+#include "../common/trace.h"
 
 #define MAX_CLIENTS 16
 #define MAX_LENGTH 256
 #define BUFFER_SIZE 1024
+#define HISTORY_SIZE 128            // Messages kept in memory (bounds history memory)
+#define HISTORY_REPLAY 32           // Messages replayed to a client when it joins
+#define DEFAULT_HIGH_WATERMARK (64 * 1024)  // Queued bytes that trigger the slow-consumer policy
+#define DEFAULT_LOW_WATERMARK (16 * 1024)   // Queued bytes the policy trims the queue back down to
+#define DEFAULT_DRAIN_TIMEOUT_MS 2000       // How long shutdown waits for outbound queues to flush
+#define DEFAULT_BACKLOG 128                 // listen() backlog of each acceptor
+#define MAX_ACCEPTORS 64
+#define HANDSHAKE_TIMEOUT_MS 5000           // How long a new connection has to send its username
+#define MAX_HANDSHAKES MAX_CLIENTS          // Connections allowed to wait for their username at once
+#define DEFAULT_BATCH_BYTES (16 * 1024)     // Queued bytes that end a batching window early
+#define FLUSH_IOV_MAX 64                    // Messages gathered into one write
+#define COMPRESS_CHUNK (16 * 1024)          // Uncompressed bytes deflated per write
+
+// What to do with a client whose outbound queue exceeds the high watermark
+typedef enum {
+    POLICY_DROP_OLDEST,             // Drop the oldest queued messages
+    POLICY_COALESCE,                // Replace the dropped messages with a single notice
+    POLICY_DISCONNECT               // Disconnect the client
+} SlowConsumerPolicy;
 
 // Global variables
 atomic_int running = 1;             // Controls the server's running state
-atomic_int shutting_down = 0;       // Ensures shutdown is triggered only once
+atomic_int shutting_down = 0;       // Set once the server is draining connections
+int shutdown_pipe[2];               // Written by the signal handler to wake the accept loop
+int stats_pipe[2];                  // Written on SIGUSR1, the acceptor that reads it prints the counters
+int drain_timeout_ms = DEFAULT_DRAIN_TIMEOUT_MS;
+int listen_backlog = DEFAULT_BACKLOG;
+int num_acceptors = 1;
+atomic_long total_rejected = 0;     // Connections refused by admission control or because the server is full
+
+// Token bucket limiting the rate of new connections, a rate of 0 disables it
+typedef struct {
+    double rate;                    // Tokens added per second
+    double burst;                   // Bucket size
+    double tokens;
+    struct timespec last_refill;
+    pthread_mutex_t mutex;
+} TokenBucket;
+
+TokenBucket admission = { 0, 0, 0, { 0, 0 }, PTHREAD_MUTEX_INITIALIZER };
+
+// One listening socket, bound with SO_REUSEPORT so the kernel spreads connections across acceptors
+typedef struct {
+    int id;
+    int socket;
+    long accepted;                  // Every accepted socket, refused ones included
+    pthread_t thread;
+} Acceptor;
+
+SlowConsumerPolicy slow_policy = POLICY_DROP_OLDEST;
+size_t high_watermark = DEFAULT_HIGH_WATERMARK;
+size_t low_watermark = DEFAULT_LOW_WATERMARK;
+atomic_long total_queued_bytes = 0; // Bytes waiting in all outbound queues
+atomic_long peak_queued_bytes = 0;  // Highest total_queued_bytes seen
+atomic_long total_dropped_messages = 0;
+atomic_long total_slow_disconnects = 0;
+int batch_window_us = 0;            // How long to hold messages back to coalesce them, 0 sends immediately
+size_t batch_bytes = DEFAULT_BATCH_BYTES;
+atomic_long total_messages_sent = 0;
+atomic_long total_send_calls = 0;
+atomic_long total_wire_bytes = 0;
+
+// A message waiting to be sent to one client
+typedef struct OutMessage {
+    struct OutMessage *next;
+    int length;
+    char data[];
+} OutMessage;
 
 typedef struct {
     int socket;
     char name[MAX_LENGTH];
     char ip[INET_ADDRSTRLEN];
     int port;
-    pthread_t thread;
+
+    // Outbound queue, filled by any thread and drained only by the client's own thread
+    pthread_mutex_t out_mutex;
+    OutMessage *out_head;
+    OutMessage *out_tail;
+    int out_offset;                 // Bytes of out_head already sent
+    int out_in_flight;              // Messages at the head being sent or deflated without out_mutex
+    size_t queued_bytes;
+    long dropped_messages;
+    int slow_disconnect;            // Set when the disconnect policy fires
+    int draining;                   // Set at shutdown, the thread exits once the queue is flushed
+    int wake_pipe[2];               // Wakes the client's thread when its queue becomes non-empty
+    long long batch_start;          // When the oldest queued message was queued, in nanoseconds
+
+    // Outbound deflate stream, negotiated at handshake
+    int compress;
+    z_stream zstream;
+    unsigned char *zbuf;            // Compressed bytes not yet sent
+    int zbuf_size;
+    int zbuf_length;
+    int zbuf_offset;
 } Client;
 
-Client clients[MAX_CLIENTS];
+Client *clients[MAX_CLIENTS];
 int client_count = 0;
+int active_threads = 0;             // Client threads that have not exited yet, bounded by
+                                    // MAX_CLIENTS + MAX_HANDSHAKES
 pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t threads_done = PTHREAD_COND_INITIALIZER;
+
+// Message history: a ring of the last HISTORY_SIZE messages plus an optional append-only log file
+typedef struct {
+    int length;
+    char text[BUFFER_SIZE];
+} HistoryEntry;
+
+HistoryEntry history[HISTORY_SIZE];
+int history_head = 0;               // Index of the oldest message in the ring
+int history_count = 0;
+int history_fd = -1;                // Append-only log file, -1 when history is not persisted
+long history_appended = 0;          // Messages ever added to the ring
+long history_written = 0;           // Messages handed to the log file, both under history_mutex
+pthread_mutex_t history_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t history_write_mutex = PTHREAD_MUTEX_INITIALIZER;  // Held by the thread writing the log
+char history_write_buffer[HISTORY_SIZE * BUFFER_SIZE];             // Guarded by history_write_mutex
 
 // Function prototypes
 void *handle_client(void *arg);
@@ -33,192 +150,1050 @@ void broadcast_message(const char *message, int exclude_socket);
 void send_whisper(const char *message, const char *target_name, const char *sender_name);
 void cleanup_clients();
 void sigint_handler(int sig);
+void sigusr1_handler(int sig);
+int history_open(const char *filename);
+void history_append(const char *message);
+void history_flush();
+int history_snapshot(char *buffer, int max_messages);
+Client *create_client(int client_socket);
+void destroy_client(Client *client);
+void remove_client(Client *client);
+void enqueue_message(Client *client, const char *message, int length);
+int flush_client(Client *client);
+void print_flow_stats();
+int open_listener(const char *port, int reuse_port);
+void *acceptor_thread(void *arg);
+void client_thread_done();
+int admit_connection();
+int register_client(Client *client);
+int enable_compression(Client *client);
+
+void usage(const char *program) {
+    printf("Usage: %s [-H history_file] [-P drop|coalesce|disconnect] [-W high_watermark] [-L low_watermark]"
+           " [-D drain_timeout_ms] [-A acceptors] [-B backlog] [-R connections_per_sec[:burst]]"
+           " [-T batch_window_us] [-S batch_bytes] <port>\n", program);
+}
 
 // Main Function
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        printf("Usage: %s <port>\n", argv[0]);
+    const char *history_file = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "H:P:W:L:D:A:B:R:T:S:")) != -1) {
+        if (opt == 'H') {
+            history_file = optarg;
+        } else if (opt == 'P' && strcmp(optarg, "drop") == 0) {
+            slow_policy = POLICY_DROP_OLDEST;
+        } else if (opt == 'P' && strcmp(optarg, "coalesce") == 0) {
+            slow_policy = POLICY_COALESCE;
+        } else if (opt == 'P' && strcmp(optarg, "disconnect") == 0) {
+            slow_policy = POLICY_DISCONNECT;
+        } else if (opt == 'W' && atol(optarg) > 0) {
+            high_watermark = atol(optarg);
+        } else if (opt == 'L' && atol(optarg) >= 0) {
+            low_watermark = atol(optarg);
+        } else if (opt == 'D' && atoi(optarg) >= 0) {
+            drain_timeout_ms = atoi(optarg);
+        } else if (opt == 'A' && atoi(optarg) > 0 && atoi(optarg) <= MAX_ACCEPTORS) {
+            num_acceptors = atoi(optarg);
+        } else if (opt == 'B' && atoi(optarg) > 0) {
+            listen_backlog = atoi(optarg);
+        } else if (opt == 'R' && atof(optarg) > 0) {
+            char *burst = strchr(optarg, ':');
+            admission.rate = atof(optarg);
+            admission.burst = burst ? atof(burst + 1) : admission.rate;
+            if (admission.burst < 1) admission.burst = 1;
+            admission.tokens = admission.burst;
+            clock_gettime(CLOCK_MONOTONIC, &admission.last_refill);
+        } else if (opt == 'T' && atoi(optarg) >= 0) {
+            batch_window_us = atoi(optarg);
+        } else if (opt == 'S' && atol(optarg) > 0) {
+            batch_bytes = atol(optarg);
+        } else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (argc - optind != 1 || low_watermark > high_watermark) {
+        usage(argv[0]);
         return EXIT_FAILURE;
     }
+    const char *port = argv[optind];
 
-    int server_socket;
-    struct sockaddr_in server_addr;
+    trace_init("hw3server");
+    trace_thread_name("main");
+
+    // Load persisted history before accepting anyone
+    if (history_file && history_open(history_file) == -1) {
+        return EXIT_FAILURE;
+    }
 
-    // Signal handler for Ctrl+C
+    // Signal handler for Ctrl+C and for termination requests, both wake the accept loop through a pipe
+    if (pipe(shutdown_pipe) == -1) {
+        perror("Pipe creation failed");
+        return EXIT_FAILURE;
+    }
+    fcntl(shutdown_pipe[1], F_SETFL, O_NONBLOCK);
     signal(SIGINT, sigint_handler);
+    signal(SIGTERM, sigint_handler);
+    // SIGUSR1 prints the flow-control counters of the running server, e.g. kill -USR1 <pid>
+    if (pipe2(stats_pipe, O_NONBLOCK) == -1) {
+        perror("Pipe creation failed");
+        return EXIT_FAILURE;
+    }
+    signal(SIGUSR1, sigusr1_handler);
+    // A peer that disconnects mid-write must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // Create one listening socket per acceptor. Several acceptors share the port through SO_REUSEPORT,
+    // which would also let a second server join in, so the port is first bound exclusively to make
+    // sure no one else is listening on it.
+    int reuse_port = num_acceptors > 1;
+    if (reuse_port) {
+        int probe = open_listener(port, 0);
+        if (probe == -1) return EXIT_FAILURE;
+        close(probe);
+    }
+    Acceptor acceptors[MAX_ACCEPTORS];
+    for (int i = 0; i < num_acceptors; i++) {
+        acceptors[i].id = i;
+        acceptors[i].accepted = 0;
+        acceptors[i].socket = open_listener(port, reuse_port);
+        if (acceptors[i].socket == -1) return EXIT_FAILURE;
+    }
+
+    printf("Server listening on port %s...\n", port);
+
+    for (int i = 0; i < num_acceptors; i++) {
+        pthread_create(&acceptors[i].thread, NULL, acceptor_thread, &acceptors[i]);
+    }
+
+    // The acceptors return once a shutdown is requested
+    for (int i = 0; i < num_acceptors; i++) {
+        pthread_join(acceptors[i].thread, NULL);
+        printf("Acceptor %d accepted %ld connections\n", i, acceptors[i].accepted);
+    }
+
+    // Listeners are closed by now, new connections are refused by the kernel from here on
+    cleanup_clients();
+    if (history_fd != -1) close(history_fd);
+    print_flow_stats();
+    lockprof_report(stdout);  // Only prints anything when built with -DLOCK_PROFILE
+
+    // Final shutdown message
+    printf("Server shut down successfully.\n");
+    fflush(stdout);
+
+    return 0;
+}
+
+// Handle Ctrl+C to stop the server
+volatile sig_atomic_t shutdown_triggered = 0;
+
+void sigint_handler(int sig) {
+    if (!shutdown_triggered) {
+        static const char message[] = "\nInterrupt received. Shutting down server...\n";
+        shutdown_triggered = 1;
+        // Only async-signal-safe calls here, the main loop does the actual shutdown
+        if (write(STDOUT_FILENO, message, sizeof(message) - 1) == -1) {
+            // Nothing useful can be done about a failed write in a signal handler
+        }
+        atomic_store(&running, 0);  // Stop the main server loop
+        if (write(shutdown_pipe[1], "", 1) == -1) {
+            // The pipe already holds a wakeup byte
+        }
+    }
+}
+
+// Ask an acceptor to print the counters, printf is not async-signal-safe
+void sigusr1_handler(int sig) {
+    (void)sig;
+    if (write(stats_pipe[1], "", 1) == -1) {
+        // A report is already pending
+    }
+}
+
+
+// Broadcast a message to all clients except the excluded socket.
+// Messages are only queued here; each client's thread does the actual send, so a client
+// that stops reading cannot stall the sender or hold clients_mutex. The history ring is
+// updated under clients_mutex to keep its order, the log file is written after it is released.
+void broadcast_message(const char *message, int exclude_socket) {
+    int length = strlen(message);
+
+    TRACE_BEGIN(broadcast_start);
+    MUTEX_LOCK(&clients_mutex);
+    history_append(message);
+    for (int i = 0; i < client_count; i++) {
+        if (clients[i]->socket != exclude_socket) {
+            enqueue_message(clients[i], message, length);
+        }
+    }
+    MUTEX_UNLOCK(&clients_mutex);
+    TRACE_END(broadcast_start, "broadcast", "hw3");
+
+    history_flush();
+}
+
+// Send a whisper message to a specific client
+void send_whisper(const char *message, const char *target_name, const char *sender_name) {
+    MUTEX_LOCK(&clients_mutex);
+    for (int i = 0; i < client_count; i++) {
+        if (strcmp(clients[i]->name, target_name) == 0) {
+            char formatted_message[BUFFER_SIZE];
+            snprintf(formatted_message, sizeof(formatted_message), "(Whisper from %s): %s\n", sender_name, message);
+            enqueue_message(clients[i], formatted_message, strlen(formatted_message));
+            MUTEX_UNLOCK(&clients_mutex);
+            return;
+        }
+    }
+    MUTEX_UNLOCK(&clients_mutex);
+}
+
+// Monotonic time in nanoseconds
+static long long now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Allocate a client with an empty outbound queue
+Client *create_client(int client_socket) {
+    Client *client = (Client *)calloc(1, sizeof(Client));
+    if (client == NULL) return NULL;
+
+    if (pipe(client->wake_pipe) == -1) {
+        free(client);
+        return NULL;
+    }
+    fcntl(client->wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(client->wake_pipe[1], F_SETFL, O_NONBLOCK);
+    pthread_mutex_init(&client->out_mutex, NULL);
+    client->socket = client_socket;
+
+    return client;
+}
+
+// Release a client that is no longer in the clients list
+void destroy_client(Client *client) {
+    OutMessage *msg = client->out_head;
+    while (msg) {
+        OutMessage *next = msg->next;
+        free(msg);
+        msg = next;
+    }
+    atomic_fetch_sub(&total_queued_bytes, (long)client->queued_bytes);
+    if (client->compress) deflateEnd(&client->zstream);
+    free(client->zbuf);
+
+    close(client->socket);
+    close(client->wake_pipe[0]);
+    close(client->wake_pipe[1]);
+    pthread_mutex_destroy(&client->out_mutex);
+    free(client);
+}
+
+// Remove a client from the clients list, the order of the list does not matter
+void remove_client(Client *client) {
+    MUTEX_LOCK(&clients_mutex);
+    for (int i = 0; i < client_count; i++) {
+        if (clients[i] == client) {
+            clients[i] = clients[--client_count];
+            break;
+        }
+    }
+    MUTEX_UNLOCK(&clients_mutex);
+}
+
+// Drop queued messages (never the partially sent head or the messages in flight) until the queue
+// plus incoming bytes fit under the low watermark. Returns the number of messages dropped. Called
+// with out_mutex held.
+static int trim_queue(Client *client, size_t incoming) {
+    int dropped = 0;
+    int keep = client->out_in_flight;
+    OutMessage **link = &client->out_head;
+
+    // The head may already be partially on the wire, so it has to stay
+    if (keep == 0 && client->out_offset > 0) keep = 1;
+    while (keep-- > 0 && *link) link = &(*link)->next;
+
+    while (*link && client->queued_bytes + incoming > low_watermark) {
+        OutMessage *victim = *link;
+        *link = victim->next;
+        client->queued_bytes -= victim->length;
+        atomic_fetch_sub(&total_queued_bytes, victim->length);
+        free(victim);
+        dropped++;
+    }
+    client->out_tail = client->out_head;
+    while (client->out_tail && client->out_tail->next) client->out_tail = client->out_tail->next;
+
+    return dropped;
+}
+
+// Append a message to a client's outbound queue, applying the slow-consumer policy
+void enqueue_message(Client *client, const char *message, int length) {
+    char notice[64];
+    int notice_length = 0;
+
+    MUTEX_LOCK(&client->out_mutex);
+    if (client->slow_disconnect) {
+        MUTEX_UNLOCK(&client->out_mutex);
+        return;
+    }
+
+    if (client->queued_bytes + length > high_watermark) {
+        if (slow_policy == POLICY_DISCONNECT) {
+            client->slow_disconnect = 1;
+            atomic_fetch_add(&total_slow_disconnects, 1);
+            MUTEX_UNLOCK(&client->out_mutex);
+            if (write(client->wake_pipe[1], "", 1) == -1 && errno != EAGAIN) perror("Failed to wake client");
+            return;
+        }
+
+        if (slow_policy == POLICY_COALESCE) {
+            notice_length = snprintf(notice, sizeof(notice), "*** messages skipped, you are reading too slowly ***\n");
+        }
+        int dropped = trim_queue(client, length + notice_length);
+        client->dropped_messages += dropped;
+        atomic_fetch_add(&total_dropped_messages, dropped);
+        if (dropped == 0) notice_length = 0;
+    }
+
+    int was_empty = client->out_head == NULL;
+    size_t queued_before = client->queued_bytes;
+    if (was_empty) client->batch_start = now_ns();
+    for (int part = notice_length > 0 ? 0 : 1; part < 2; part++) {
+        const char *data = part == 0 ? notice : message;
+        int data_length = part == 0 ? notice_length : length;
+
+        OutMessage *msg = malloc(sizeof(OutMessage) + data_length);
+        if (msg == NULL) break;
+        msg->next = NULL;
+        msg->length = data_length;
+        memcpy(msg->data, data, data_length);
+        if (client->out_tail) client->out_tail->next = msg;
+        else client->out_head = msg;
+        client->out_tail = msg;
+        client->queued_bytes += data_length;
+        long queued = atomic_fetch_add(&total_queued_bytes, data_length) + data_length;
+        long peak = atomic_load(&peak_queued_bytes);
+        while (queued > peak && !atomic_compare_exchange_weak(&peak_queued_bytes, &peak, queued)) {
+            // peak now holds the current value, retry while ours is still higher
+        }
+    }
+    // Only the empty -> non-empty transition and a full batch need to wake the client's thread
+    int wake = was_empty || (queued_before < batch_bytes && client->queued_bytes >= batch_bytes);
+    MUTEX_UNLOCK(&client->out_mutex);
+
+    if (wake && write(client->wake_pipe[1], "", 1) == -1 && errno != EAGAIN) {
+        perror("Failed to wake client");
+    }
+}
+
+// Remove up to length bytes from the front of the outbound queue. Called with out_mutex held.
+static void consume_queue(Client *client, size_t length) {
+    client->queued_bytes -= length;
+    atomic_fetch_sub(&total_queued_bytes, length);
+
+    while (length > 0) {
+        OutMessage *msg = client->out_head;
+        size_t left = msg->length - client->out_offset;
+        if (length < left) {
+            client->out_offset += length;
+            return;
+        }
+        length -= left;
+        client->out_head = msg->next;
+        if (client->out_head == NULL) client->out_tail = NULL;
+        client->out_offset = 0;
+        free(msg);
+        atomic_fetch_add(&total_messages_sent, 1);
+    }
+}
+
+// Point iov at up to max_count messages from the head of the queue, stopping once max_bytes are
+// gathered, and mark them in flight so that trim_queue leaves them alone while they are used
+// without out_mutex. Returns the number of iovecs. Called with out_mutex held.
+static int gather_queue(Client *client, struct iovec *iov, int max_count, size_t max_bytes) {
+    int count = 0;
+    size_t bytes = 0;
+
+    for (OutMessage *msg = client->out_head; msg && count < max_count && bytes < max_bytes; msg = msg->next) {
+        int offset = count == 0 ? client->out_offset : 0;
+        iov[count].iov_base = msg->data + offset;
+        iov[count].iov_len = msg->length - offset;
+        bytes += iov[count].iov_len;
+        count++;
+    }
+    client->out_in_flight = count;
+    return count;
+}
+
+// Deflate up to COMPRESS_CHUNK queued bytes into zbuf, ending with a sync flush so the client can
+// decode everything sent so far. out_mutex is only held to gather and then dequeue the messages.
+// Returns the number of bytes deflated, 0 when the queue is empty, or -1 on failure.
+static long compress_queue(Client *client) {
+    struct iovec iov[FLUSH_IOV_MAX];
+    z_stream *stream = &client->zstream;
+    long consumed = 0;
+    int failed = 0;
+
+    MUTEX_LOCK(&client->out_mutex);
+    int count = gather_queue(client, iov, FLUSH_IOV_MAX, COMPRESS_CHUNK);
+    MUTEX_UNLOCK(&client->out_mutex);
+
+    client->zbuf_length = 0;
+    client->zbuf_offset = 0;
+    for (int i = 0; i < count && !failed; i++) {
+        stream->next_in = iov[i].iov_base;
+        stream->avail_in = iov[i].iov_len;
+        do {
+            // Make room for the output, deflate is called until it stops filling the buffer
+            if (client->zbuf_size - client->zbuf_length < 256) {
+                int size = client->zbuf_size ? client->zbuf_size * 2 : COMPRESS_CHUNK;
+                unsigned char *zbuf = realloc(client->zbuf, size);
+                if (zbuf == NULL) {
+                    failed = 1;
+                    break;
+                }
+                client->zbuf = zbuf;
+                client->zbuf_size = size;
+            }
+            stream->next_out = client->zbuf + client->zbuf_length;
+            stream->avail_out = client->zbuf_size - client->zbuf_length;
+            if (deflate(stream, i == count - 1 ? Z_SYNC_FLUSH : Z_NO_FLUSH) == Z_STREAM_ERROR) {
+                failed = 1;
+                break;
+            }
+            client->zbuf_length = client->zbuf_size - stream->avail_out;
+        } while (stream->avail_out == 0);
+        consumed += iov[i].iov_len;
+    }
+
+    MUTEX_LOCK(&client->out_mutex);
+    client->out_in_flight = 0;
+    consume_queue(client, consumed);
+    MUTEX_UNLOCK(&client->out_mutex);
+
+    return failed ? -1 : consumed;
+}
+
+// Send as much of the outbound queue as the socket accepts without blocking. Queued messages are
+// gathered into a single write, or deflated into one buffer when the client negotiated compression.
+// out_mutex is not held during the write or the deflate, so senders queueing for this client are
+// never held up by it. Returns 1 if data is still queued, 0 if the queue is empty and -1 if the
+// connection failed.
+int flush_client(Client *client) {
+    int result = 0;
+
+    TRACE_BEGIN(send_start);
+    while (1) {
+        ssize_t sent;
+
+        if (client->compress) {
+            if (client->zbuf_offset == client->zbuf_length) {
+                long deflated = compress_queue(client);
+                if (deflated <= 0) {
+                    result = (int)deflated;
+                    break;
+                }
+            }
+            sent = send(client->socket, client->zbuf + client->zbuf_offset,
+                        client->zbuf_length - client->zbuf_offset, MSG_NOSIGNAL);
+            if (sent > 0) client->zbuf_offset += sent;
+        } else {
+            struct iovec iov[FLUSH_IOV_MAX];
+            struct msghdr header;
+
+            MUTEX_LOCK(&client->out_mutex);
+            int count = gather_queue(client, iov, FLUSH_IOV_MAX, SIZE_MAX);
+            MUTEX_UNLOCK(&client->out_mutex);
+            if (count == 0) break;
+
+            memset(&header, 0, sizeof(header));
+            header.msg_iov = iov;
+            header.msg_iovlen = count;
+            sent = sendmsg(client->socket, &header, MSG_NOSIGNAL);
+            int send_errno = errno;
+
+            MUTEX_LOCK(&client->out_mutex);
+            client->out_in_flight = 0;
+            if (sent > 0) consume_queue(client, sent);
+            MUTEX_UNLOCK(&client->out_mutex);
+            errno = send_errno;
+        }
+
+        if (sent == -1) {
+            result = (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 1 : -1;
+            break;
+        }
+        atomic_fetch_add(&total_send_calls, 1);
+        atomic_fetch_add(&total_wire_bytes, sent);
+    }
+    TRACE_END(send_start, "send", "hw3");
+
+    return result;
+}
+
+// Whether anything is waiting to be sent. Called with out_mutex held.
+static int has_output(Client *client) {
+    return client->out_head != NULL || client->zbuf_offset < client->zbuf_length;
+}
+
+// When the queued messages should be written: at once, or at the end of the batching window
+// unless a full batch is already waiting. Called with out_mutex held.
+static long long flush_time(Client *client) {
+    if (batch_window_us == 0 || client->draining || client->queued_bytes >= batch_bytes) return 0;
+    if (client->zbuf_offset < client->zbuf_length) return 0;
+    return client->batch_start + (long long)batch_window_us * 1000;
+}
+
+// Start a deflate stream for the client's outbound messages
+int enable_compression(Client *client) {
+    memset(&client->zstream, 0, sizeof(client->zstream));
+    // Chat lines are short and latency matters more than ratio, so favour speed
+    if (deflateInit(&client->zstream, Z_BEST_SPEED) != Z_OK) return -1;
+    client->compress = 1;
+    return 0;
+}
+
+// Print the flow-control counters, at shutdown and on SIGUSR1
+void print_flow_stats() {
+    printf("Flow control: %ld bytes queued (peak %ld), %ld messages dropped, %ld slow clients disconnected\n",
+           atomic_load(&total_queued_bytes), atomic_load(&peak_queued_bytes), atomic_load(&total_dropped_messages),
+           atomic_load(&total_slow_disconnects));
+    printf("Admission control: %ld connections rejected\n", atomic_load(&total_rejected));
+    printf("Delivery: %ld messages in %ld writes, %ld bytes on the wire\n",
+           atomic_load(&total_messages_sent), atomic_load(&total_send_calls), atomic_load(&total_wire_bytes));
+}
+
+// Create a non-blocking listening socket on port, shared with the other acceptors through SO_REUSEPORT
+// when reuse_port is set
+int open_listener(const char *port, int reuse_port) {
+    struct sockaddr_in server_addr;
+    int enable = 1;
 
     // Create server socket
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
+    int server_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (server_socket == -1) {
         perror("Socket creation failed");
-        return EXIT_FAILURE;
+        return -1;
+    }
+    if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) == -1 ||
+        (reuse_port && setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) == -1)) {
+        perror("setsockopt failed");
+        close(server_socket);
+        return -1;
     }
 
     // Configure server address
+    memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(atoi(argv[1]));
+    server_addr.sin_port = htons(atoi(port));
 
     // Bind the socket
     if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
         perror("Bind failed");
         close(server_socket);
-        return EXIT_FAILURE;
+        return -1;
     }
 
     // Listen for incoming connections
-    if (listen(server_socket, MAX_CLIENTS) == -1) {
+    if (listen(server_socket, listen_backlog) == -1) {
         perror("Listen failed");
         close(server_socket);
-        return EXIT_FAILURE;
+        return -1;
     }
 
-    printf("Server listening on port %s...\n", argv[1]);
+    return server_socket;
+}
+
+// Take a token from the admission bucket, returns 0 when the connection has to be refused
+int admit_connection() {
+    if (admission.rate == 0) return 1;
+
+    MUTEX_LOCK(&admission.mutex);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - admission.last_refill.tv_sec) + (now.tv_nsec - admission.last_refill.tv_nsec) / 1e9;
+    admission.last_refill = now;
+    admission.tokens += elapsed * admission.rate;
+    if (admission.tokens > admission.burst) admission.tokens = admission.burst;
+
+    int admitted = admission.tokens >= 1;
+    if (admitted) admission.tokens -= 1;
+    MUTEX_UNLOCK(&admission.mutex);
+
+    return admitted;
+}
+
+// Accept connections until shutdown. Each wakeup drains the whole accept queue, and the
+// handshake happens on the client's own thread so a slow client cannot hold up the next one.
+void *acceptor_thread(void *arg) {
+    Acceptor *acceptor = (Acceptor *)arg;
+    pthread_attr_t client_attr;
+
+    // Client threads are created detached, they release their own resources when done
+    pthread_attr_init(&client_attr);
+    pthread_attr_setdetachstate(&client_attr, PTHREAD_CREATE_DETACHED);
+
+    if (trace_enabled) {
+        char thread_name[32];
+        snprintf(thread_name, sizeof(thread_name), "acceptor %d", acceptor->id);
+        trace_thread_name(thread_name);
+    }
 
-    // Main loop to accept and handle clients
     while (atomic_load(&running)) {
-        int client_socket;
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
+        // Wait for connections, a shutdown request or a request for the counters
+        struct pollfd fds[3];
+        fds[0].fd = acceptor->socket;
+        fds[0].events = POLLIN;
+        fds[1].fd = shutdown_pipe[0];
+        fds[1].events = POLLIN;
+        fds[2].fd = stats_pipe[0];
+        fds[2].events = POLLIN;
+        if (poll(fds, 3, -1) == -1) {
+            if (errno == EINTR) continue;
+            perror("poll failed");
+            break;
+        }
+        if (!atomic_load(&running) || (fds[1].revents & POLLIN)) break; // Exit if the server is shutting down
+
+        // Every acceptor wakes up, only the one that gets the byte prints
+        char request;
+        if ((fds[2].revents & POLLIN) && read(stats_pipe[0], &request, 1) == 1) {
+            print_flow_stats();
+            fflush(stdout);
+        }
 
-        client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &client_len);
+        while (1) {
+            struct sockaddr_in client_addr;
+            socklen_t client_len = sizeof(client_addr);
 
-        if (!atomic_load(&running)) break; // Exit if the server is shutting down
-        if (client_socket == -1) {
-            if (atomic_load(&running)) perror("Accept failed");
-            continue;
+            int client_socket = accept4(acceptor->socket, (struct sockaddr *)&client_addr, &client_len,
+                                        SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (client_socket == -1) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+                    perror("Accept failed");
+                }
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                break;
+            }
+            acceptor->accepted++;
+
+            // Every connection gets a thread, so their number is capped even without the token bucket.
+            // The busy notice goes out before any compression is negotiated, so it is always plain text.
+            MUTEX_LOCK(&clients_mutex);
+            int admitted = active_threads < MAX_CLIENTS + MAX_HANDSHAKES;
+            if (admitted) active_threads++;
+            MUTEX_UNLOCK(&clients_mutex);
+            if (admitted && !admit_connection()) {
+                client_thread_done();
+                admitted = 0;
+            }
+            if (!admitted) {
+                atomic_fetch_add(&total_rejected, 1);
+                send(client_socket, "Server is busy, try again later\n", 32, MSG_NOSIGNAL);
+                close(client_socket);
+                continue;
+            }
+
+            // Allocate memory for the new client
+            Client *new_client = create_client(client_socket);
+            if (new_client == NULL) {
+                perror("Failed to allocate client");
+                close(client_socket);
+                client_thread_done();
+                continue;
+            }
+            inet_ntop(AF_INET, &client_addr.sin_addr, new_client->ip, sizeof(new_client->ip));
+            new_client->port = ntohs(client_addr.sin_port);
+
+            // Create a thread to handle the new client. Once it runs, the thread may free new_client
+            // at any moment, so new_client must not be touched after a successful pthread_create.
+            pthread_t client_thread;
+            if (pthread_create(&client_thread, &client_attr, handle_client, (void *)new_client) != 0) {
+                perror("Failed to create client thread");
+                destroy_client(new_client);
+                client_thread_done();
+                continue;
+            }
         }
+    }
+
+    pthread_attr_destroy(&client_attr);
+    close(acceptor->socket);
+    return NULL;
+}
+
+// Receive the client's username and add it to the chat. Returns -1 if the client was not added.
+int register_client(Client *client) {
+    int received = 0;
+
+    // Receive client's username, giving up on clients that stay silent or on shutdown
+    while (received == 0) {
+        struct pollfd fds[2];
+        fds[0].fd = client->socket;
+        fds[0].events = POLLIN;
+        fds[1].fd = shutdown_pipe[0];
+        fds[1].events = POLLIN;
+        int ready = poll(fds, 2, HANDSHAKE_TIMEOUT_MS);
+        if (ready == -1 && errno == EINTR) continue;
+        if (ready <= 0 || (fds[1].revents & POLLIN)) return -1;
 
-        // Allocate memory for the new client
-        Client *new_client = (Client *)malloc(sizeof(Client));
-        new_client->socket = client_socket;
-        inet_ntop(AF_INET, &client_addr.sin_addr, new_client->ip, sizeof(new_client->ip));
-        new_client->port = ntohs(client_addr.sin_port);
-
-        // Receive client's username
-        if (recv(client_socket, new_client->name, MAX_LENGTH, 0) <= 0) {
-            perror("Failed to receive username");
-            close(client_socket);
-            free(new_client);
+        received = recv(client->socket, client->name, MAX_LENGTH - 1, 0);
+        if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            received = 0;
             continue;
         }
-        new_client->name[strcspn(new_client->name, "\n")] = '\0';  // Remove newline character
+        if (received <= 0) {
+            if (received == -1) perror("Failed to receive username");
+            return -1;
+        }
+    }
+    // The username may be followed by handshake options on the next line
+    char *options = strchr(client->name, '\n');
+    if (options) {
+        *options++ = '\0';  // Remove newline character
+        if (strstr(options, "compress=deflate") && enable_compression(client) == -1) {
+            printf("Failed to start compression for %s\n", client->name);
+            return -1;
+        }
+    }
 
-        // Add client to the list
-        pthread_mutex_lock(&clients_mutex);
-        clients[client_count++] = *new_client;
-        pthread_mutex_unlock(&clients_mutex);
+    // Add client to the list. The history snapshot is queued under the same lock so that
+    // every message is either replayed or delivered live, never both, and in order.
+    char *replay = malloc((size_t)HISTORY_REPLAY * BUFFER_SIZE);
+    MUTEX_LOCK(&clients_mutex);
+    if (client_count == MAX_CLIENTS || atomic_load(&shutting_down)) {
+        MUTEX_UNLOCK(&clients_mutex);
+        printf("Rejected %s: server is full\n", client->name);
+        atomic_fetch_add(&total_rejected, 1);
+        // Goes through the queue so that it is deflated like everything else if compression was negotiated
+        enqueue_message(client, "Server is full\n", 15);
+        flush_client(client);
+        free(replay);
+        return -1;
+    }
+    if (replay) {
+        int replay_length = history_snapshot(replay, HISTORY_REPLAY);
+        if (replay_length > 0) enqueue_message(client, replay, replay_length);
+    }
+    clients[client_count++] = client;
+    MUTEX_UNLOCK(&clients_mutex);
+    free(replay);
+
+    // Notify of connection
+    printf("%s connected from %s using port %d\n", client->name, client->ip, client->port);
+    char join_message[BUFFER_SIZE];
+    snprintf(join_message, sizeof(join_message), "%s has joined the chat\n", client->name);
+    broadcast_message(join_message, -1);
 
-        // Notify of connection
-        printf("%s connected from %s using port %d\n", new_client->name, new_client->ip, new_client->port);
-        char join_message[BUFFER_SIZE];
-        snprintf(join_message, sizeof(join_message), "%s has joined the chat\n", new_client->name);
-        broadcast_message(join_message, -1);
+    return 0;
+}
 
-        // Create a thread to handle the new client
-        pthread_create(&new_client->thread, NULL, handle_client, (void *)new_client);
+// Open (or create) the history log and load its tail into the in-memory ring
+int history_open(const char *filename) {
+    history_fd = open(filename, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (history_fd == -1) {
+        perror("Failed to open history file");
+        return -1;
     }
 
-    // Ensure cleanup is performed
-    cleanup_clients();
-    close(server_socket);
+    struct stat st;
+    if (fstat(history_fd, &st) == -1) {
+        perror("Failed to stat history file");
+        return -1;
+    }
+    if (st.st_size == 0) return 0;
 
-    // Final shutdown message
-    printf("Server shut down successfully.\n");
-    fflush(stdout);
+    // Map the log and walk back from the end to find the start of the last HISTORY_SIZE messages,
+    // so startup cost depends on the ring size and not on the length of the log
+    char *log = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, history_fd, 0);
+    if (log == MAP_FAILED) {
+        perror("Failed to map history file");
+        return -1;
+    }
+    off_t start = st.st_size;
+    int lines = 0;
+    if (log[start - 1] == '\n') start--;
+    while (start > 0 && lines < HISTORY_SIZE) {
+        start--;
+        if (log[start] == '\n' && ++lines == HISTORY_SIZE) {
+            start++;
+            break;
+        }
+    }
 
+    // Load the messages without writing them back to the log
+    while (start < st.st_size) {
+        char *end = memchr(log + start, '\n', st.st_size - start);
+        off_t length = end ? end - (log + start) + 1 : st.st_size - start;
+        char message[BUFFER_SIZE];
+        if (length > BUFFER_SIZE - 1) length = BUFFER_SIZE - 1;
+        memcpy(message, log + start, length);
+        message[length] = '\0';
+        history_append(message);
+        start = end ? end - log + 1 : st.st_size;
+    }
+    history_written = history_appended;
+
+    munmap(log, st.st_size);
     return 0;
 }
 
-// Handle Ctrl+C to stop the server
-volatile sig_atomic_t shutdown_triggered = 0;
+// Record a broadcast message in the history ring, history_flush writes it to the log file
+void history_append(const char *message) {
+    int length = strlen(message);
+    if (length == 0) return;
+    if (length > BUFFER_SIZE - 1) length = BUFFER_SIZE - 1;
+    // The log and the replay are split at newlines, so every entry must end in one. A message that
+    // snprintf truncated has lost its newline, its last byte is replaced by one.
+    int add_newline = message[length - 1] != '\n';
+    if (add_newline && length == BUFFER_SIZE - 1) length--;
 
-void sigint_handler(int sig) {
-    if (!shutdown_triggered) {
-        shutdown_triggered = 1;
-        printf("\nInterrupt received. Shutting down server...\n");
-        fflush(stdout);  // Ensure the message is displayed immediately
-        atomic_store(&running, 0);  // Stop the main server loop
+    MUTEX_LOCK(&history_mutex);
+    HistoryEntry *entry;
+    if (history_count < HISTORY_SIZE) {
+        entry = &history[(history_head + history_count++) % HISTORY_SIZE];
+    } else {
+        // Ring is full, overwrite the oldest message
+        entry = &history[history_head];
+        history_head = (history_head + 1) % HISTORY_SIZE;
     }
+    memcpy(entry->text, message, length);
+    if (add_newline) entry->text[length++] = '\n';
+    entry->length = length;
+    history_appended++;
+    MUTEX_UNLOCK(&history_mutex);
 }
 
+// Copy the messages not yet written out of the ring, returns the number of bytes copied.
+// Called with history_mutex and history_write_mutex held.
+static int history_take_pending() {
+    long pending = history_appended - history_written;
+    int length = 0;
 
-// Broadcast a message to all clients except the excluded socket
-void broadcast_message(const char *message, int exclude_socket) {
-    pthread_mutex_lock(&clients_mutex);
-    for (int i = 0; i < client_count; i++) {
-        if (clients[i].socket != exclude_socket) {
-            send(clients[i].socket, message, strlen(message), 0);
-        }
+    if (pending > history_count) {
+        // The writer fell so far behind that the ring overwrote messages before they were written
+        fprintf(stderr, "History log fell behind, %ld messages not written\n", pending - history_count);
+        pending = history_count;
+    }
+    for (long i = history_count - pending; i < history_count; i++) {
+        HistoryEntry *entry = &history[(history_head + i) % HISTORY_SIZE];
+        memcpy(history_write_buffer + length, entry->text, entry->length);
+        length += entry->length;
     }
-    pthread_mutex_unlock(&clients_mutex);
+    history_written = history_appended;
+    return length;
 }
 
-// Send a whisper message to a specific client
-void send_whisper(const char *message, const char *target_name, const char *sender_name) {
-    pthread_mutex_lock(&clients_mutex);
-    for (int i = 0; i < client_count; i++) {
-        if (strcmp(clients[i].name, target_name) == 0) {
-            char formatted_message[BUFFER_SIZE];
-            snprintf(formatted_message, sizeof(formatted_message), "(Whisper from %s): %s\n", sender_name, message);
-            send(clients[i].socket, formatted_message, strlen(formatted_message), 0);
-            pthread_mutex_unlock(&clients_mutex);
-            return;
+// Append the pending history messages to the log file outside of clients_mutex and history_mutex.
+// One thread writes at a time; a thread that finds the writer busy leaves its messages to it, and
+// the writer checks for new messages after releasing history_write_mutex so none are left behind.
+void history_flush() {
+    if (history_fd == -1) return;
+
+    while (pthread_mutex_trylock(&history_write_mutex) == 0) {
+        MUTEX_LOCK(&history_mutex);
+        int length = history_take_pending();
+        MUTEX_UNLOCK(&history_mutex);
+
+        if (length > 0 && write(history_fd, history_write_buffer, length) != length) {
+            perror("Failed to write history");
         }
+        pthread_mutex_unlock(&history_write_mutex);
+
+        MUTEX_LOCK(&history_mutex);
+        int more = history_appended != history_written;
+        MUTEX_UNLOCK(&history_mutex);
+        if (!more) break;
     }
-    pthread_mutex_unlock(&clients_mutex);
 }
 
-// Cleanup all clients during server shutdown
+// Copy the last max_messages messages into buffer, returns the number of bytes copied
+int history_snapshot(char *buffer, int max_messages) {
+    int length = 0;
+
+    MUTEX_LOCK(&history_mutex);
+    int count = history_count < max_messages ? history_count : max_messages;
+    for (int i = history_count - count; i < history_count; i++) {
+        HistoryEntry *entry = &history[(history_head + i) % HISTORY_SIZE];
+        memcpy(buffer + length, entry->text, entry->length);
+        length += entry->length;
+    }
+    MUTEX_UNLOCK(&history_mutex);
+
+    return length;
+}
+
+// Add milliseconds to the current CLOCK_REALTIME time, for pthread_cond_timedwait
+static struct timespec deadline_after(int milliseconds) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += milliseconds / 1000;
+    deadline.tv_nsec += (long)(milliseconds % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    return deadline;
+}
+
+// Wait until every client thread has exited or the deadline passes. Called with clients_mutex held.
+static void wait_for_threads(const struct timespec *deadline) {
+    while (active_threads > 0) {
+        if (COND_TIMEDWAIT(&threads_done, &clients_mutex, deadline) != 0) break;
+    }
+}
+
+// Drain all clients during server shutdown. Every client thread flushes its own queue and closes
+// its own connection, so connections are closed in parallel. Takes at most twice the drain timeout.
 void cleanup_clients() {
-    pthread_mutex_lock(&clients_mutex);
+    static const char notice[] = "Server is shutting down...\n";
+
+    atomic_store(&shutting_down, 1);
+
+    MUTEX_LOCK(&clients_mutex);
     for (int i = 0; i < client_count; i++) {
-        // Notify client about server shutdown
-        send(clients[i].socket, "Server is shutting down...\n", 28, 0);
-        
-        // Close the client socket
-        close(clients[i].socket);
+        Client *client = clients[i];
 
-        // Wait for the client thread to finish
-        pthread_join(clients[i].thread, NULL);
+        // Notify client about server shutdown, then tell its thread to finish once that is sent
+        enqueue_message(client, notice, sizeof(notice) - 1);
+        MUTEX_LOCK(&client->out_mutex);
+        client->draining = 1;
+        MUTEX_UNLOCK(&client->out_mutex);
+        if (write(client->wake_pipe[1], "", 1) == -1 && errno != EAGAIN) perror("Failed to wake client");
     }
-    client_count = 0;
-    pthread_mutex_unlock(&clients_mutex);
+
+    struct timespec deadline = deadline_after(drain_timeout_ms);
+    wait_for_threads(&deadline);
+
+    // Clients that did not read their queue in time are cut off
+    if (active_threads > 0) {
+        printf("Drain timeout, closing %d remaining connections\n", client_count);
+        for (int i = 0; i < client_count; i++) {
+            shutdown(clients[i]->socket, SHUT_RDWR);
+        }
+        deadline = deadline_after(drain_timeout_ms);
+        wait_for_threads(&deadline);
+    }
+    MUTEX_UNLOCK(&clients_mutex);
 }
 
 
-// Thread for handling a single client
+// Let a draining shutdown know that a client thread is about to exit
+void client_thread_done() {
+    MUTEX_LOCK(&clients_mutex);
+    active_threads--;
+    pthread_cond_broadcast(&threads_done);
+    MUTEX_UNLOCK(&clients_mutex);
+}
+
+// Thread for handling a single client: reads its messages and drains its outbound queue
 void *handle_client(void *arg) {
     Client *client = (Client *)arg;
     char buffer[BUFFER_SIZE];
-    int bytes_received;
+    int bytes_received = 1;
+    int pending = 1;
+    int draining = 0;
+    long long flush_at = 0;
+
+    if (register_client(client) == -1) {
+        destroy_client(client);
+        client_thread_done();
+        pthread_exit(NULL);
+    }
+    if (trace_enabled) {
+        char thread_name[MAX_LENGTH + 8];
+        snprintf(thread_name, sizeof(thread_name), "client %s", client->name);
+        trace_thread_name(thread_name);
+    }
+
+    while (1) {
+        struct pollfd fds[2];
+        struct timespec timeout;
+        struct timespec *timeout_ptr = NULL;
+
+        // Inside a batching window the socket is not polled for writing, the window end wakes us
+        long long wait = pending ? flush_at - now_ns() : 0;
+        if (wait > 0) {
+            timeout.tv_sec = wait / 1000000000LL;
+            timeout.tv_nsec = wait % 1000000000LL;
+            timeout_ptr = &timeout;
+        }
 
-    while ((bytes_received = recv(client->socket, buffer, sizeof(buffer) - 1, 0)) > 0) {
+        fds[0].fd = client->socket;
+        // While draining nothing more is read, only the outbound queue matters
+        fds[0].events = (draining ? 0 : POLLIN) | (pending && wait <= 0 ? POLLOUT : 0);
+        fds[1].fd = client->wake_pipe[0];
+        fds[1].events = POLLIN;
+
+        if (ppoll(fds, 2, timeout_ptr, NULL) == -1) {
+            if (errno == EINTR) continue;
+            perror("poll failed");
+            bytes_received = -1;
+            break;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            char drain[64];
+            while (read(client->wake_pipe[0], drain, sizeof(drain)) > 0) {
+                // Drain the wakeup bytes
+            }
+        }
+
+        MUTEX_LOCK(&client->out_mutex);
+        int slow_disconnect = client->slow_disconnect;
+        draining = client->draining;
+        pending = has_output(client);
+        flush_at = flush_time(client);
+        MUTEX_UNLOCK(&client->out_mutex);
+        if (slow_disconnect) {
+            printf("Client %s is not reading, disconnecting\n", client->name);
+
+            remove_client(client);
+            char disconnect_message[BUFFER_SIZE];
+            snprintf(disconnect_message, sizeof(disconnect_message), "%s disconnected\n", client->name);
+            broadcast_message(disconnect_message, -1);
+
+            break;
+        }
+
+        if (pending && flush_at <= now_ns()) {
+            pending = flush_client(client);
+            if (pending == -1) {
+                bytes_received = -1;
+                break;
+            }
+        }
+
+        if (draining && (!pending || (fds[0].revents & (POLLHUP | POLLERR)))) {
+            remove_client(client);
+            break;
+        }
+
+        if (draining || !(fds[0].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+        TRACE_BEGIN(recv_start);
+        bytes_received = recv(client->socket, buffer, sizeof(buffer) - 1, 0);
+        TRACE_END(recv_start, "recv", "hw3");
+        if (bytes_received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) continue;
+        if (bytes_received <= 0) break;
         buffer[bytes_received] = '\0';  // Null-terminate the received message
 
         // Handle special message "!exit"
         if (strcmp(buffer, "!exit") == 0) {
             printf("Client %s exiting...\n", client->name);
 
-            // Notify all clients about the disconnection
+            // Remove client from the list, then notify all clients about the disconnection
+            remove_client(client);
             char disconnect_message[BUFFER_SIZE];
             snprintf(disconnect_message, sizeof(disconnect_message), "%s has left the chat\n", client->name);
             broadcast_message(disconnect_message, -1);
 
-            // Remove client from the list
-            pthread_mutex_lock(&clients_mutex);
-            for (int i = 0; i < client_count; i++) {
-                if (clients[i].socket == client->socket) {
-                    // Shift remaining clients
-                    for (int j = i; j < client_count - 1; j++) {
-                        clients[j] = clients[j + 1];
-                    }
-                    client_count--;
-                    break;
-                }
-            }
-            pthread_mutex_unlock(&clients_mutex);
-
             break;  // Exit the loop to clean up and close socket
         }
 
@@ -230,7 +1205,7 @@ void *handle_client(void *arg) {
                 send_whisper(whisper_message, target_name, client->name);
             } else {
                 char error_message[] = "Invalid whisper format. Use @username message.\n";
-                send(client->socket, error_message, strlen(error_message), 0);
+                enqueue_message(client, error_message, strlen(error_message));
             }
             continue;
         }
@@ -244,25 +1219,19 @@ void *handle_client(void *arg) {
     if (bytes_received <= 0) {
         printf("Client %s disconnected unexpectedly\n", client->name);
 
-        pthread_mutex_lock(&clients_mutex);
-        for (int i = 0; i < client_count; i++) {
-            if (clients[i].socket == client->socket) {
-                char disconnect_message[BUFFER_SIZE];
-                snprintf(disconnect_message, sizeof(disconnect_message), "%s disconnected\n", clients[i].name);
-                broadcast_message(disconnect_message, -1);
-
-                // Shift remaining clients
-                for (int j = i; j < client_count - 1; j++) {
-                    clients[j] = clients[j + 1];
-                }
-                client_count--;
-                break;
-            }
+        remove_client(client);
+        // Nobody is interested in departures while the whole server is going down
+        if (!atomic_load(&shutting_down)) {
+            char disconnect_message[BUFFER_SIZE];
+            snprintf(disconnect_message, sizeof(disconnect_message), "%s disconnected\n", client->name);
+            broadcast_message(disconnect_message, -1);
         }
-        pthread_mutex_unlock(&clients_mutex);
     }
 
-    close(client->socket);
-    free(client);
+    if (client->dropped_messages > 0) {
+        printf("Client %s: %ld messages dropped\n", client->name, client->dropped_messages);
+    }
+    destroy_client(client);
+    client_thread_done();
     pthread_exit(NULL);
 }